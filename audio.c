@@ -1,303 +1,969 @@
-#include <asoundlib.h>
+#define _GNU_SOURCE
 #include <errno.h>
+#include <string.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 
 #include "audio.h"
-
-struct audio_data {
-	int channels;
-	int rate;
-	int nsamples;
-	struct audio_data *next;
-	int16_t samples[0];
+#include "hist.h"
+#include "log.h"
+#include "resample.h"
+#include "status.h"
+#include "trace.h"
+
+/*
+ * Samples travel from music_delivery() to the ALSA thread through a single
+ * producer/single consumer ring of interleaved int16 frames. head is only
+ * advanced by audio_push(), tail only by audio_main() (and by audio_flush(),
+ * which moves it forward with a CAS so the consumer notices).
+ *
+ * Both indices count frames and increase monotonically. The ring holds
+ * frames of a single format. With a fixed output format configured, every
+ * delivery is converted into it on the way in and the device is opened once.
+ * Otherwise audio_push() publishes a new rate/channel count as the next
+ * format generation and refuses frames until the ALSA thread, once it has
+ * drained the ring, switches to it. Only the ALSA thread changes the ring's
+ * format after audio_init().
+ *
+ * audio_push() stops accepting frames once the ring holds target_ms of
+ * audio. The target starts at the low watermark, doubles (up to the high
+ * watermark) on every underrun and creeps back down after STABLE_SECS of
+ * clean playback.
+ */
+#define RING_SAMPLES (1 << 18)
+#define CACHE_LINE   64
+
+#define BUFFER_MIN_MS 1000
+#define BUFFER_MAX_MS 4000
+#define STABLE_SECS   30
+
+/* Assumed worst case when sizing the ring for a source-following output */
+#define MAX_RATE      48000
+
+/* Stack the audio thread faults in and locks before it starts playing */
+#define STACK_PREFAULT (64 * 1024)
+
+struct audio_ring {
+	_Alignas(CACHE_LINE) atomic_size_t head;
+	_Alignas(CACHE_LINE) atomic_size_t tail;
+	_Alignas(CACHE_LINE) atomic_int rate;
+	atomic_int channels;
+	size_t size;
+	int16_t *samples;
 };
 
-static int audio_state;
+static atomic_int audio_state;
 
 static pthread_t thread;
-static pthread_mutex_t mutex;
-static pthread_cond_t cond;
+static int wakeup_fd;
+static atomic_size_t wake_at;
+static atomic_int flush_req;
+
+static struct audio_ring ring;
+static struct audio_config config;
+static size_t ring_samples;
+static atomic_int target_ms;
+
+/* Producer side only */
+static struct resampler rs;
+
+/*
+ * Format requested by audio_push() for generation fmt_gen; the ALSA thread
+ * sets fmt_ack to the generation it has switched the ring to. fmt_rate and
+ * fmt_channels only change while the two are equal.
+ */
+static int fmt_rate;
+static int fmt_channels;
+static atomic_uint fmt_gen;
+static atomic_uint fmt_ack;
+
+/* Selected output backend and its argument, see audio.h */
+static const struct audio_output *out;
+static const char *out_arg;
+
+#define MAX_OUT_FDS 8
+
+static const struct audio_output *outputs[] = {
+	&alsa_output, &null_output, &wav_output, &pipe_output, NULL
+};
+
+/* Written by the ALSA thread only */
+static atomic_ulong stat_writes;
+static atomic_ulong stat_wakeups;
+static atomic_ulong stat_frames;
+static atomic_uint  stat_writes_ps;
+static atomic_uint  stat_wakeups_ps;
+static atomic_ulong stat_xruns;
+
+/* Written by audio_push() only: source frames accepted */
+static atomic_ulong stat_delivered;
+
+/*
+ * What audio_start() actually got, see struct audio_stats. The audio
+ * thread clears rt_locked if it can't lock its stack.
+ */
+static int rt_policy;
+static int rt_priority;
+static int rt_pinned;
+static atomic_int rt_locked;
+
+static atomic_ulong stat_reopens;
+
+/*
+ * Latency and depth histograms, see audio_format_stats(). The ALSA thread
+ * is the only writer.
+ */
+static struct hist hist_latency;   /* audio_push() to output write, us */
+static struct hist hist_depth;     /* ring depth at each write, ms */
+static struct hist hist_delay;     /* output delay after each write, ms */
+static struct hist hist_write;     /* duration of each output write, us */
+
+/*
+ * audio_push() leaves a timestamped mark at the end of each delivery; the
+ * ALSA thread retires the marks it writes past. Marks are only a sample:
+ * when the consumer lags, new ones are dropped.
+ */
+#define MARKS 64
+
+struct mark {
+	size_t frame;
+	uint64_t ns;
+};
 
-struct audio_data *head;
-struct audio_data *tail;
-static int q_frames;
+static struct mark marks[MARKS];
+static _Alignas(CACHE_LINE) atomic_size_t mark_head;
+static _Alignas(CACHE_LINE) atomic_size_t mark_tail;
+
+/*
+ * Playback clock, written by the ALSA thread after every output write
+ * under a seqlock: at clock_ns the frame being heard was clock_written -
+ * clock_delay (ring indices), and playback moves on in real time from
+ * there, never past clock_written. track_start is the ring index of the
+ * latest track's first frame, track_prev that of the one before it, which
+ * is still playing until the ALSA thread gets to track_start.
+ */
+static atomic_uint clock_seq;
+static size_t clock_written;
+static long clock_delay;
+static int clock_rate;
+static uint64_t clock_ns;
+static atomic_size_t track_start;
+static atomic_size_t track_prev;
+
+/* Bumped by audio_mark_track(); the ALSA thread copies it once at track_start */
+static atomic_uint track_marks;
+static atomic_uint track_reached;
+
+/* Underruns not yet reported through audio_stutter() */
+static atomic_int stutter;
+
+/* ALSA thread only: wait for the low watermark after an underrun */
+static int prefill;
+static struct timespec stable_since;
+
+/* ALSA thread only: an output call failed and the output has to be reopened */
+static int out_failed;
 
 static void *audio_main(void *);
 
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void wakeup_audio()
+{
+	uint64_t one = 1;
+
+	if (write(wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("audio: eventfd");
+}
+
 int audio_buffered()
 {
-	return q_frames;
+	size_t t = atomic_load_explicit(&ring.tail, memory_order_acquire);
+
+	return atomic_load_explicit(&ring.head, memory_order_acquire) - t;
+}
+
+unsigned int audio_mark_track()
+{
+	unsigned int m;
+
+	atomic_store(&track_prev, atomic_load(&track_start));
+	atomic_store(&track_start, atomic_load(&ring.head));
+	m = atomic_fetch_add(&track_marks, 1) + 1;
+
+	/* The ALSA thread may already be past it, idle */
+	wakeup_audio();
+	return m;
+}
+
+unsigned int audio_track_reached()
+{
+	return atomic_load(&track_reached);
+}
+
+/*
+ * Milliseconds of the current track heard by ns, given the clock.
+ */
+static long clock_position(size_t written, long delay, int rate, uint64_t at, uint64_t ns)
+{
+	size_t start = atomic_load(&track_start);
+	uint64_t ahead;
+
+	if (written < start)
+		start = atomic_load(&track_prev);
+	if (!rate || written < start)
+		return 0;
+
+	ahead = ns > at ? (ns - at) * rate / 1000000000ULL : 0;
+	if (ahead > (uint64_t) delay)
+		ahead = delay;
+
+	written = written - delay + ahead;
+	return written > start ? (written - start) * 1000 / rate : 0;
+}
+
+static void clock_update(size_t written, long delay, int rate, uint64_t ns)
+{
+	unsigned int s = atomic_load_explicit(&clock_seq, memory_order_relaxed);
+
+	atomic_store_explicit(&clock_seq, s + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	clock_written = written;
+	clock_delay = delay;
+	clock_rate = rate;
+	clock_ns = ns;
+
+	atomic_store_explicit(&clock_seq, s + 2, memory_order_release);
+}
+
+long audio_position_ms()
+{
+	size_t written;
+	long delay;
+	int rate;
+	uint64_t at;
+	unsigned int s;
+
+	do {
+		while ((s = atomic_load_explicit(&clock_seq, memory_order_acquire)) & 1)
+			;
+		written = clock_written;
+		delay = clock_delay;
+		rate = clock_rate;
+		at = clock_ns;
+		atomic_thread_fence(memory_order_acquire);
+	} while (atomic_load_explicit(&clock_seq, memory_order_relaxed) != s);
+
+	return clock_position(written, delay, rate, at, now_ns());
 }
 
 void audio_flush()
 {
-	struct audio_data *ad;
+	size_t t = atomic_load(&ring.tail);
 
-	pthread_mutex_lock(&mutex);
+	while (!atomic_compare_exchange_weak(&ring.tail, &t, atomic_load(&ring.head)))
+		;
 
-	while (head) {
-		ad = head->next;
-		free(head);
-		head = ad;
-	}
+	/* Let the ALSA thread drop what the device still holds as well */
+	atomic_store(&flush_req, 1);
+	wakeup_audio();
+}
 
-	tail = NULL;
-	q_frames = 0;
-	
-	pthread_mutex_unlock(&mutex);
+/*
+ * Switch the ring to a new format. Only called while nothing else touches
+ * the ring: from audio_init(), or on the ALSA thread once it is empty and
+ * audio_push() is waiting for fmt_ack.
+ */
+static void ring_format(int rate, int channels)
+{
+	atomic_store_explicit(&ring.rate, rate, memory_order_relaxed);
+	atomic_store_explicit(&ring.channels, channels, memory_order_relaxed);
+	ring.size = ring_samples / channels;
 }
 
 int audio_push(const void *fs, size_t n, int rate, int channels, int bits)
 {
-	struct audio_data *ad;
-	size_t s;
+	size_t h, t, o, k, m, room, used;
+	const int16_t *src = fs;
+	int oc;
 
-    if (n == 0)
+	if (n == 0)
 		return 0;
 
-	pthread_mutex_lock(&mutex);
+	/* Still waiting for the ALSA thread to switch formats */
+	if (atomic_load_explicit(&fmt_ack, memory_order_acquire) !=
+	    atomic_load_explicit(&fmt_gen, memory_order_relaxed))
+		return 0;
 
-	if (q_frames > rate) {
-		pthread_mutex_unlock(&mutex);
+	if (!config.rate && (rate != rs.out_rate || channels != rs.out_channels)) {
+		fmt_rate = rate;
+		fmt_channels = channels;
+		resampler_init(&rs, rate, channels);
+		atomic_fetch_add_explicit(&fmt_gen, 1, memory_order_release);
+		wakeup_audio();
 		return 0;
 	}
 
-	s = n * sizeof(int16_t) * channels;
-	ad = malloc(sizeof(struct audio_data) + s);
-	memcpy(ad->samples, fs, s);
+	h = atomic_load_explicit(&ring.head, memory_order_relaxed);
+	t = atomic_load_explicit(&ring.tail, memory_order_acquire);
 
-	ad->channels = channels;
-	ad->rate = rate;
-	ad->nsamples = n;
-	ad->next = NULL;
+	if (h - t > (size_t) ring.rate * atomic_load_explicit(&target_ms, memory_order_relaxed) / 1000)
+		return 0;
 
-	if (tail)
-		tail->next = ad;
-	tail = ad;
+	oc = ring.channels;
+	room = ring.size - (h - t);
+	o = h % ring.size;
 
-	if (!head)
-		head = tail;
+	/* Convert up to the end of the ring, then wrap to its start */
+	used = n;
+	m = resampler_run(&rs, rate, channels, src, &used,
+	                  ring.samples + o * oc, room < ring.size - o ? room : ring.size - o);
 
-	q_frames += n;
+	if (used < n && m == ring.size - o && m < room) {
+		k = n - used;
+		m += resampler_run(&rs, rate, channels, src + used * channels, &k,
+		                   ring.samples, room - m);
+		used += k;
+	}
 
-	pthread_cond_signal(&cond);
-	pthread_mutex_unlock(&mutex);
+	atomic_store_explicit(&ring.head, h + m, memory_order_release);
+	atomic_fetch_add_explicit(&stat_delivered, used, memory_order_relaxed);
+
+	o = atomic_load_explicit(&mark_head, memory_order_relaxed);
+	if (m && o - atomic_load_explicit(&mark_tail, memory_order_acquire) < MARKS) {
+		marks[o % MARKS].frame = h + m;
+		marks[o % MARKS].ns = now_ns();
+		atomic_store_explicit(&mark_head, o + 1, memory_order_release);
+	}
 
-	return n;
+	atomic_thread_fence(memory_order_seq_cst);
+	o = atomic_load(&wake_at);
+	if (o && h + m >= o && atomic_compare_exchange_strong(&wake_at, &o, 0))
+		wakeup_audio();
+
+	return used;
 }
 
-int audio_init()
+void audio_get_stats(struct audio_stats *st)
 {
-    pthread_mutex_init(&mutex, NULL);
-    pthread_cond_init(&cond, NULL);
-    return 0;
+	int rate;
+
+	st->writes = atomic_load_explicit(&stat_writes, memory_order_relaxed);
+	st->wakeups = atomic_load_explicit(&stat_wakeups, memory_order_relaxed);
+	st->frames = atomic_load_explicit(&stat_frames, memory_order_relaxed);
+	st->writes_per_sec = atomic_load_explicit(&stat_writes_ps, memory_order_relaxed);
+	st->wakeups_per_sec = atomic_load_explicit(&stat_wakeups_ps, memory_order_relaxed);
+	st->xruns = atomic_load_explicit(&stat_xruns, memory_order_relaxed);
+	st->delivered = atomic_load_explicit(&stat_delivered, memory_order_relaxed);
+	rate = atomic_load_explicit(&ring.rate, memory_order_relaxed);
+	st->buffered_ms = rate ? (long) audio_buffered() * 1000 / rate : 0;
+	st->ring_bytes = ring_samples * sizeof(int16_t);
+	st->buffer_ms = atomic_load_explicit(&target_ms, memory_order_relaxed);
+	st->rt_policy = rt_policy;
+	st->rt_priority = rt_priority;
+	st->rt_pinned = rt_pinned;
+	st->rt_locked = atomic_load(&rt_locked);
 }
 
-void audio_start()
+/*
+ * Render counters and histogram summaries as text, one metric per line.
+ */
+int audio_format_stats(char *buf, size_t len)
 {
-    audio_state = 0;
-    pthread_create(&thread, NULL, audio_main, NULL);
+	struct audio_stats st;
+	size_t n;
+
+	audio_get_stats(&st);
+
+	n = snprintf(buf, len, "frames=%lu writes=%lu wakeups=%lu xruns=%lu reopens=%lu buffer_ms=%d\n",
+	             st.frames, st.writes, st.wakeups, st.xruns,
+	             atomic_load_explicit(&stat_reopens, memory_order_relaxed), st.buffer_ms);
+	if (n < len)
+		n += hist_format(&hist_latency, "latency_us", buf + n, len - n);
+	if (n < len)
+		n += hist_format(&hist_depth, "depth_ms", buf + n, len - n);
+	if (n < len)
+		n += hist_format(&hist_delay, "delay_ms", buf + n, len - n);
+	if (n < len)
+		n += hist_format(&hist_write, "write_us", buf + n, len - n);
+
+	return n < len ? n : len - 1;
 }
 
-void audio_stop()
+int audio_stutter()
 {
-    pthread_mutex_lock(&mutex);
-    audio_state = 1;
-    pthread_cond_signal(&cond);
-    pthread_mutex_unlock(&mutex);
-    pthread_join(thread, NULL);
+	return atomic_exchange(&stutter, 0);
 }
 
-
-static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
+/*
+ * Resolve "name[:arg]" to an output backend.
+ */
+static int select_output(const char *spec)
 {
-	snd_pcm_hw_params_t *hwp;
-	snd_pcm_sw_params_t *swp;
-	snd_pcm_t *h;
-	int r, dir;
-
-	snd_pcm_uframes_t period_size_min;
-	snd_pcm_uframes_t period_size_max;
-	snd_pcm_uframes_t buffer_size_min;
-	snd_pcm_uframes_t buffer_size_max;
-	snd_pcm_uframes_t period_size;
-	snd_pcm_uframes_t buffer_size;
-
-	if ((r = snd_pcm_open(&h, dev, SND_PCM_STREAM_PLAYBACK, 0) < 0))
-		return NULL;
-
-	hwp = alloca(snd_pcm_hw_params_sizeof());
-	memset(hwp, 0, snd_pcm_hw_params_sizeof());
-	snd_pcm_hw_params_any(h, hwp);
-
-	assert(snd_pcm_hw_params_set_rate_resample(h, hwp, 1) >= 0);
-	assert(snd_pcm_hw_params_set_access(h, hwp, SND_PCM_ACCESS_RW_INTERLEAVED) >= 0);
-	assert(snd_pcm_hw_params_set_format(h, hwp, SND_PCM_FORMAT_S16_LE) >= 0);
-	assert(snd_pcm_hw_params_set_rate(h, hwp, rate, 0) >= 0);
-	assert(snd_pcm_hw_params_set_channels(h, hwp, channels) >= 0);
-
-	/* Configurue period */
-
-	dir = 0;
-	snd_pcm_hw_params_get_period_size_min(hwp, &period_size_min, &dir);
-	dir = 0;
-	snd_pcm_hw_params_get_period_size_max(hwp, &period_size_max, &dir);
-
-	period_size = 1024;
-
-	dir = 0;
-	r = snd_pcm_hw_params_set_period_size_near(h, hwp, &period_size, &dir);
-	if (r < 0) {
-		fprintf(stderr, "audio: Unable to set period size %lu (%s)\n",
-		        period_size, snd_strerror(r));
-		snd_pcm_close(h);
-		return NULL;
-	}
+	const char *sep;
+	size_t len;
+	int i;
+
+	if (!spec)
+		spec = "alsa";
+
+	sep = strchr(spec, ':');
+	len = sep ? (size_t) (sep - spec) : strlen(spec);
 
-	dir = 0;
-	r = snd_pcm_hw_params_get_period_size(hwp, &period_size, &dir);
-	if (r < 0) {
-		fprintf(stderr, "audio: Unable to get period size (%s)\n",
-		        snd_strerror(r));
-		snd_pcm_close(h);
-		return NULL;
+	for (i = 0; outputs[i]; ++i) {
+		if (strlen(outputs[i]->name) == len && strncmp(outputs[i]->name, spec, len) == 0) {
+			out = outputs[i];
+			out_arg = sep ? sep + 1 : NULL;
+			return 0;
+		}
 	}
 
-	/* Configurue buffer size */
+	fprintf(stderr, "audio: Unknown output '%s'\n", spec);
+	return -1;
+}
 
-	snd_pcm_hw_params_get_buffer_size_min(hwp, &buffer_size_min);
-	snd_pcm_hw_params_get_buffer_size_max(hwp, &buffer_size_max);
-	buffer_size = period_size * 4;
+int audio_init(const struct audio_config *cfg)
+{
+	if (cfg)
+		config = *cfg;
 
-	dir = 0;
-	r = snd_pcm_hw_params_set_buffer_size_near(h, hwp, &buffer_size);
-	if (r < 0) {
-		fprintf(stderr, "audio: Unable to set buffer size %lu (%s)\n",
-		        buffer_size, snd_strerror(r));
-		snd_pcm_close(h);
-		return NULL;
-	}
+	if (select_output(config.output) < 0)
+		return -1;
 
-	r = snd_pcm_hw_params_get_buffer_size(hwp, &buffer_size);
-	if (r < 0) {
-		fprintf(stderr, "audio: Unable to get buffer size (%s)\n",
-		        snd_strerror(r));
-		snd_pcm_close(h);
-		return NULL;
+	if (out == &wav_output && !config.rate) {
+		fprintf(stderr, "audio: The wav output needs a fixed output format (-r)\n");
+		return -1;
 	}
 
-	/* write the hw params */
-	r = snd_pcm_hw_params(h, hwp);
-	if (r < 0) {
-		fprintf(stderr, "audio: Unable to configure hardware parameters (%s)\n",
-		        snd_strerror(r));
-		snd_pcm_close(h);
-		return NULL;
-	}
+	if (config.rate && !config.channels)
+		config.channels = 2;
+
+	if (config.channels < 0 || config.channels > RESAMPLE_MAX_CHANNELS)
+		return -1;
+
+	if (config.buffer_min_ms <= 0)
+		config.buffer_min_ms = BUFFER_MIN_MS;
+	if (config.buffer_max_ms <= 0)
+		config.buffer_max_ms = BUFFER_MAX_MS;
+	if (config.buffer_max_ms < config.buffer_min_ms)
+		config.buffer_max_ms = config.buffer_min_ms;
+	atomic_init(&target_ms, config.buffer_min_ms);
+
+	/* Room for the high watermark plus whatever arrives while at it */
+	ring_samples = (size_t) (config.rate ? config.rate : MAX_RATE) *
+	               (config.channels ? config.channels : 2) *
+	               (config.buffer_max_ms + 500) / 1000;
+	if (ring_samples < RING_SAMPLES)
+		ring_samples = RING_SAMPLES;
+
+	if (posix_memalign((void **) &ring.samples, CACHE_LINE, ring_samples * sizeof(int16_t)) != 0)
+		return -1;
 
 	/*
-	 * Software parameters
+	 * Touch every page of the ring now rather than on the audio thread, and
+	 * pin what is mapped so far. Later allocations (libspotify's caches) are
+	 * deliberately left out so they cannot run into RLIMIT_MEMLOCK.
 	 */
-	swp = alloca(snd_pcm_sw_params_sizeof());
-	memset(hwp, 0, snd_pcm_sw_params_sizeof());
-	snd_pcm_sw_params_current(h, swp);
-
-	r = snd_pcm_sw_params_set_avail_min(h, swp, period_size);
-	if (r < 0) {
-		fprintf(stderr, "audio: Unable to configure wakeup threshold (%s)\n",
-		        snd_strerror(r));
-		snd_pcm_close(h);
-		return NULL;
+	memset(ring.samples, 0, ring_samples * sizeof(int16_t));
+	if (config.mlock) {
+		if (mlockall(MCL_CURRENT) == 0)
+			atomic_store(&rt_locked, 1);
+		else
+			fprintf(stderr, "audio: Unable to lock memory (%s), continuing unlocked\n",
+			        strerror(errno));
 	}
 
-	r = snd_pcm_sw_params_set_start_threshold(h, swp, 0);
-	if (r < 0) {
-		fprintf(stderr, "audio: Unable to configure start threshold (%s)\n",
-		        snd_strerror(r));
-		snd_pcm_close(h);
-		return NULL;
+	atomic_init(&ring.head, 0);
+	atomic_init(&ring.tail, 0);
+	atomic_init(&wake_at, 0);
+	atomic_init(&flush_req, 0);
+	atomic_init(&fmt_gen, 0);
+	atomic_init(&fmt_ack, 0);
+	if (config.rate)
+		ring_format(config.rate, config.channels);
+	else
+		ring_format(0, 2);
+	resampler_init(&rs, ring.rate, ring.channels);
+
+	wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup_fd < 0)
+		return -1;
+
+	return 0;
+}
+
+static int start_thread(int sched, int pin)
+{
+	pthread_attr_t attr;
+	struct sched_param sp;
+	cpu_set_t cpus;
+	int cpu, r;
+
+	pthread_attr_init(&attr);
+
+	if (sched) {
+		sp.sched_priority = config.rt_priority;
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, config.rt_policy);
+		pthread_attr_setschedparam(&attr, &sp);
 	}
 
-	r = snd_pcm_sw_params(h, swp);
-	if (r < 0) {
-		fprintf(stderr, "audio: Cannot set soft parameters (%s)\n",
-		snd_strerror(r));
-		snd_pcm_close(h);
-		return NULL;
+	if (pin) {
+		CPU_ZERO(&cpus);
+		for (cpu = 0; cpu < (int) sizeof(config.cpu_mask) * 8; ++cpu)
+			if (config.cpu_mask & (1UL << cpu))
+				CPU_SET(cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
 	}
 
-	r = snd_pcm_prepare(h);
-	if (r < 0) {
-		fprintf(stderr, "audio: Cannot prepare audio for playback (%s)\n",
-		snd_strerror(r));
-		snd_pcm_close(h);
-		return NULL;
+	r = pthread_create(&thread, &attr, audio_main, NULL);
+	pthread_attr_destroy(&attr);
+	return r;
+}
+
+/*
+ * Start the audio thread with the configured scheduling policy and CPU
+ * affinity. If the system refuses, find out which of the two it was by
+ * dropping one at a time, and go without just that one.
+ */
+void audio_start()
+{
+	int sched = config.rt_policy == SCHED_FIFO || config.rt_policy == SCHED_RR;
+	int pin = config.cpu_mask != 0;
+	struct sched_param sp;
+	cpu_set_t cpus;
+	int r, refused;
+
+	atomic_store(&audio_state, 0);
+
+	r = start_thread(sched, pin);
+	if ((r == EPERM || r == EINVAL) && (sched || pin)) {
+		refused = r;
+
+		if (sched && pin && start_thread(sched, 0) == 0) {
+			fprintf(stderr, "audio: Unable to pin the audio thread (%s), running unpinned\n",
+			        strerror(refused));
+			r = 0;
+		} else if (sched && pin && start_thread(0, pin) == 0) {
+			fprintf(stderr, "audio: Real-time scheduling refused (%s), using defaults\n",
+			        strerror(refused));
+			r = 0;
+		} else {
+			if (sched)
+				fprintf(stderr, "audio: Real-time scheduling refused (%s), using defaults\n",
+				        strerror(refused));
+			if (pin)
+				fprintf(stderr, "audio: Unable to pin the audio thread (%s), running unpinned\n",
+				        strerror(refused));
+			r = start_thread(0, 0);
+		}
 	}
 
-	return h;
+	if (r != 0) {
+		fprintf(stderr, "audio: Unable to start the audio thread (%s)\n", strerror(r));
+		abort();
+	}
+
+	/* Record what the thread ended up with, for audio_get_stats() */
+	if (pthread_getschedparam(thread, &rt_policy, &sp) == 0)
+		rt_priority = sp.sched_priority;
+
+	if (pthread_getaffinity_np(thread, sizeof(cpus), &cpus) == 0)
+		rt_pinned = config.cpu_mask && CPU_COUNT(&cpus) < sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+void audio_stop()
+{
+	atomic_store(&audio_state, 1);
+	wakeup_audio();
+	pthread_join(thread, NULL);
 }
 
+/*
+ * Roll the per-second write and wakeup rates over once a second.
+ */
+static void update_rates(struct timespec *mark, unsigned long *writes, unsigned long *wakeups)
+{
+	struct timespec now;
+	unsigned long w, k;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec == mark->tv_sec ||
+	    (now.tv_sec == mark->tv_sec + 1 && now.tv_nsec < mark->tv_nsec))
+		return;
+
+	w = atomic_load_explicit(&stat_writes, memory_order_relaxed);
+	k = atomic_load_explicit(&stat_wakeups, memory_order_relaxed);
+	atomic_store_explicit(&stat_writes_ps, w - *writes, memory_order_relaxed);
+	atomic_store_explicit(&stat_wakeups_ps, k - *wakeups, memory_order_relaxed);
+
+	*writes = w;
+	*wakeups = k;
+	*mark = now;
+}
+
+/*
+ * An underrun: restart the device, remember it for libspotify, and grow the
+ * buffer target so the next one is less likely.
+ */
+static void xrun()
+{
+	int target;
 
+	out->recover(-EPIPE);
+
+	atomic_fetch_add_explicit(&stat_xruns, 1, memory_order_relaxed);
+	atomic_fetch_add(&stutter, 1);
+
+	target = atomic_load(&target_ms) * 2;
+	if (target > config.buffer_max_ms)
+		target = config.buffer_max_ms;
+	atomic_store(&target_ms, target);
+
+	clock_gettime(CLOCK_MONOTONIC, &stable_since);
+	prefill = 1;
+}
+
+/*
+ * An output call failed with anything but an underrun. The output is
+ * closed and reopened after a back-off at the top of the main loop.
+ */
+static void out_fail(const char *call, long err)
+{
+	log_error("audio: %s on %s output failed (%s), reopening", call, out->name, strerror(-err));
+	out_failed = 1;
+}
+
+/*
+ * Shrink the buffer target by a tenth, towards the low watermark, for every
+ * STABLE_SECS of playback without an underrun.
+ */
+static void buffer_settle()
+{
+	struct timespec now;
+	int target;
+
+	target = atomic_load(&target_ms);
+	if (target <= config.buffer_min_ms)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec - stable_since.tv_sec < STABLE_SECS)
+		return;
+
+	target -= target / 10;
+	if (target < config.buffer_min_ms)
+		target = config.buffer_min_ms;
+	atomic_store(&target_ms, target);
+
+	stable_since = now;
+}
+
+/*
+ * Copy up to n whole periods from the ring into the device, in at most two
+ * writes: up to the end of the ring, then from its start. Returns the number
+ * of frames consumed.
+ */
+static size_t ring_drain(size_t t, size_t n, int channels)
+{
+	uint64_t start;
+	long c;
+	size_t o, k, w;
+
+	for (w = 0; w < n; w += c) {
+		o = (t + w) % ring.size;
+		k = n - w < ring.size - o ? n - w : ring.size - o;
+
+		start = now_ns();
+		c = out->write(ring.samples + o * channels, k);
+		hist_add(&hist_write, (now_ns() - start) / 1000);
+		atomic_fetch_add_explicit(&stat_writes, 1, memory_order_relaxed);
+		if (c < 0) {
+			if (c == -EPIPE)
+				xrun();
+			else
+				out_fail("write", c);
+			break;
+		}
+		if ((size_t) c < k)
+			return w + c;
+	}
+
+	return w;
+}
+
+/*
+ * Account for frames [from, to) having been written: retire the delivery
+ * marks inside that range into the latency histogram. Marks at or before
+ * from belong to frames that were flushed and are dropped.
+ */
+static void marks_retire(size_t from, size_t to)
+{
+	size_t mt = atomic_load_explicit(&mark_tail, memory_order_relaxed);
+	size_t mh = atomic_load_explicit(&mark_head, memory_order_acquire);
+	uint64_t now = now_ns();
+
+	for (; mt != mh && marks[mt % MARKS].frame <= to; ++mt)
+		if (marks[mt % MARKS].frame > from)
+			hist_add(&hist_latency, (now - marks[mt % MARKS].ns) / 1000);
+
+	atomic_store_explicit(&mark_tail, mt, memory_order_release);
+}
+
+/*
+ * Wait a second before trying a failed output again. Frames stay queued;
+ * stop and flush still get through.
+ */
+static void back_off(struct pollfd *fds)
+{
+	uint64_t events;
+
+	poll(fds, 1, 1000);
+	while (read(wakeup_fd, &events, sizeof(events)) > 0)
+		;
+}
+
+static int ms_until(const struct timespec *deadline)
+{
+	struct timespec now;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+	     (deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+	return ms > 0 ? ms : 0;
+}
+
+/*
+ * Fault in and lock the stack the audio thread is about to use, so that
+ * neither shows up as a page fault in the middle of playback.
+ */
+static void __attribute__((noinline)) stack_prefault()
+{
+	volatile char stack[STACK_PREFAULT];
+
+	memset((char *) stack, 0, sizeof(stack));
+	if (mlock((char *) stack, sizeof(stack)) != 0)
+		atomic_store(&rt_locked, 0);
+}
+
+/*
+ * The ALSA thread sleeps in a single poll() on the wakeup eventfd, which
+ * signals new data, flushes and stop, plus the output's own descriptors
+ * while it has frames to hand the device and the device has no room for
+ * them. Outputs without descriptors are polled once a period.
+ */
 static void *audio_main(void *data)
 {
-	int c;
+	struct pollfd fds[1 + MAX_OUT_FDS];
+	struct timespec mark, partial;
+	unsigned long writes = 0, wakeups = 0;
+	uint64_t events, now;
+	uint32_t traced = 0;
+	unsigned int gen, reached = 0;
+
+	long c;
+	size_t t, n, w, want, period = 1;
+	int nfds, timeout;
 	int cur_channels = 0;
 	int cur_rate = 0;
+	int opened = 0;
 
-	snd_pcm_t *h = NULL;
-	struct audio_data *ad;
-
-	while (audio_state == 0) {
-        pthread_mutex_lock(&mutex);
-        while (!head) {
-            if (pthread_cond_wait(&cond, &mutex) != 0) 
-                abort();
-			if (audio_state != 0) {
-				pthread_mutex_unlock(&mutex);
-				return NULL;
-			}
-        }
+	if (atomic_load(&rt_locked))
+		stack_prefault();
+	trace_thread("audio");
+
+	clock_gettime(CLOCK_MONOTONIC, &mark);
+	stable_since = mark;
+	partial.tv_sec = 0;
+
+	fds[0].fd = wakeup_fd;
+	fds[0].events = POLLIN;
+
+	while (atomic_load(&audio_state) == 0) {
+		if (out_failed) {
+			out->close();
+			opened = 0;
+			out_failed = 0;
+			back_off(fds);
+		}
+
+		if (atomic_exchange(&flush_req, 0) && opened) {
+			out->drop();
+			partial.tv_sec = 0;
+		}
+
+		t = atomic_load_explicit(&ring.tail, memory_order_acquire);
+		n = atomic_load_explicit(&ring.head, memory_order_acquire) - t;
 
+		/* Every frame before the latest track mark is out: that track is playing */
+		gen = atomic_load(&track_marks);
+		if (gen != reached && t >= atomic_load(&track_start)) {
+			reached = gen;
+			atomic_store(&track_reached, gen);
+			if (config.track_reached)
+				config.track_reached();
+		}
+
+		/* audio_push() asked for a new format; take it once the old frames are out */
+		gen = atomic_load_explicit(&fmt_gen, memory_order_acquire);
+		if (!n && gen != atomic_load_explicit(&fmt_ack, memory_order_relaxed)) {
+			ring_format(fmt_rate, fmt_channels);
+			atomic_store_explicit(&fmt_ack, gen, memory_order_release);
+		}
 
-		ad = head;
-		head = ad->next;
-		q_frames -= ad->nsamples;
-		pthread_mutex_unlock(&mutex);
+		if (n && (!opened || cur_rate != ring.rate || cur_channels != ring.channels)) {
+			if (opened)
+				out->close();
 
-		if (!h || cur_rate != ad->rate || cur_channels != ad->channels) {
-			if (h)
-				snd_pcm_close(h);
+			cur_rate = ring.rate;
+			cur_channels = ring.channels;
 
-			cur_rate = ad->rate;
-			cur_channels = ad->channels;
-			//fprintf(stderr, "Opening ALSA: %d %dHz\n", cur_channels, cur_rate); 
+			if (opened)
+				atomic_fetch_add_explicit(&stat_reopens, 1, memory_order_relaxed);
 
-			h = alsa_open("default", cur_rate, cur_channels);
-			if (!h) {
-				fprintf(stderr, "Unable to open ALSA device (%d channels, %d Hz), dying\n",
-				        cur_channels, cur_rate);
-				exit(1);
+			opened = out->open(out_arg, cur_rate, cur_channels, &period) == 0;
+			if (!opened) {
+				log_error("audio: Unable to open %s output (%d channels, %d Hz), retrying",
+				          out->name, cur_channels, cur_rate);
+				back_off(fds);
+				continue;
 			}
+
+			/* Hand the output whole periods */
+			partial.tv_sec = 0;
+		}
+
+		/* After an underrun, build the buffer back up to the low watermark */
+		want = period;
+		if (prefill && (size_t) cur_rate * config.buffer_min_ms / 1000 > want)
+			want = (size_t) cur_rate * config.buffer_min_ms / 1000;
+
+		/* A short tail is written anyway once it has waited that long */
+		if (n >= want || n == 0) {
+			partial.tv_sec = 0;
+		} else if (!partial.tv_sec) {
+			clock_gettime(CLOCK_MONOTONIC, &partial);
+			partial.tv_nsec += want * 1000000000ULL / cur_rate;
+			partial.tv_sec += partial.tv_nsec / 1000000000L;
+			partial.tv_nsec %= 1000000000L;
 		}
 
-		c = snd_pcm_wait(h, 1000);
-		if (c >= 0)
-			c = snd_pcm_avail_update(h);
+		nfds = 1;
+		timeout = -1;
+
+		if (n >= want || (n && !ms_until(&partial))) {
+			c = out->avail();
+			if (c < 0) {
+				if (c == -EPIPE)
+					xrun();
+				else
+					out_fail("avail", c);
+				continue;
+			}
+
+			if (n > (size_t) c)
+				n = c;
+			if (n >= period)
+				n -= n % period;
+
+			if (n) {
+				hist_add(&hist_depth, (atomic_load(&ring.head) - t) * 1000 / cur_rate);
+
+				w = ring_drain(t, n, cur_channels);
+				marks_retire(t, t + w);
+
+				/* The track id first: play_track() marks the track before it opens one */
+				if (w && trace_track() != traced && t + w > atomic_load(&track_start))
+					trace_track_reached(TRACE_FIRST_WRITE, &traced);
+
+				c = out->delay();
+				if (c < 0 && !out_failed) {
+					if (c == -EPIPE)
+						xrun();
+					else
+						out_fail("delay", c);
+				}
+				if (c >= 0)
+					hist_add(&hist_delay, c * 1000 / cur_rate);
+				else
+					c = 0;
+
+				now = now_ns();
+				clock_update(t + w, c, cur_rate, now);
+
+				atomic_fetch_add_explicit(&stat_frames, w, memory_order_relaxed);
+				status_set_audio((atomic_load(&ring.head) - t - w + c) * 1000 / cur_rate,
+				                 atomic_load_explicit(&stat_frames, memory_order_relaxed),
+				                 atomic_load_explicit(&stat_xruns, memory_order_relaxed),
+				                 clock_position(t + w, c, cur_rate, now, now),
+				                 c * 1000 / cur_rate);
+				update_rates(&mark, &writes, &wakeups);
+				buffer_settle();
+				if (w)
+					prefill = 0;
+
+				/* A failed CAS means audio_flush() moved tail under our feet */
+				atomic_compare_exchange_strong(&ring.tail, &t, t + w);
+				continue;
+			}
 
-		if (c == -EPIPE)
-			snd_pcm_prepare(h);
+			/* The device is full, wait for it to drain a period */
+			nfds += out->poll_fds(fds + 1, MAX_OUT_FDS);
+			if (nfds == 1)
+				timeout = period * 1000 / cur_rate + 1;
+		} else {
+			/* Ask audio_push() to wake us once enough frames are in */
+			w = n ? t + want : t + 1;
+			atomic_store(&wake_at, w);
+			atomic_thread_fence(memory_order_seq_cst);
+
+			if (atomic_load_explicit(&ring.head, memory_order_acquire) >= w) {
+				atomic_store(&wake_at, 0);
+				continue;
+			}
 
-		if (snd_pcm_writei(h, ad->samples, ad->nsamples) < 0) {
-			fprintf(stderr, "Failed to write to pcm\n");
+			if (n)
+				timeout = ms_until(&partial) + 1;
 		}
 
-		free(ad);
+		atomic_fetch_add_explicit(&stat_wakeups, 1, memory_order_relaxed);
+
+		if (poll(fds, nfds, timeout) < 0) {
+			if (errno != EINTR)
+				log_error("audio: poll (%s)", strerror(errno));
+			continue;
+		}
+
+		atomic_store(&wake_at, 0);
+
+		if (fds[0].revents & POLLIN)
+			while (read(wakeup_fd, &events, sizeof(events)) > 0)
+				;
+
+		if (nfds > 1 && out->poll_revents(fds + 1, nfds - 1) == -EPIPE)
+			xrun();
 	}
 
+	if (opened)
+		out->close();
+
 	return NULL;
 }
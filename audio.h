@@ -1,12 +1,109 @@
 #ifndef _AUDIO_H_
 #define _AUDIO_H_
 
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A non-zero rate opens the output once in that format and converts every
+ * delivery to it. With rate 0 the output follows the source format.
+ *
+ * The buffer target moves between the low and high watermark (in ms) as
+ * underruns come and go; zero picks the defaults.
+ *
+ * output selects the backend as "name[:arg]", e.g. "alsa:hw:0", "null",
+ * "null:fast", "wav:out.wav" or "pipe:-". NULL means the default ALSA device.
+ *
+ * rt_policy may ask for SCHED_FIFO or SCHED_RR at rt_priority, cpu_mask pins
+ * the audio thread (bit n is CPU n, 0 leaves it unpinned) and mlock locks
+ * the prefaulted audio buffers into memory. Whatever the system refuses is
+ * dropped with a message; audio_get_stats() tells what was granted.
+ *
+ * track_reached, if set, is called on the audio thread whenever
+ * audio_track_reached() moves on. It must not block.
+ */
+struct audio_config {
+	const char *output;
+	int rate;
+	int channels;
+	int buffer_min_ms;
+	int buffer_max_ms;
+	int rt_policy;
+	int rt_priority;
+	unsigned long cpu_mask;
+	int mlock;
+	void (*track_reached)(void);
+};
+
+struct audio_stats {
+	unsigned long writes;
+	unsigned long wakeups;
+	unsigned long frames;
+	unsigned int  writes_per_sec;
+	unsigned int  wakeups_per_sec;
+	unsigned long xruns;
+	unsigned long delivered;     /* frames accepted by audio_push() */
+	int           buffered_ms;   /* waiting in the ring */
+	int           buffer_ms;     /* target, see struct audio_config */
+	int           rt_policy;
+	int           rt_priority;
+	int           rt_pinned;
+	int           rt_locked;
+	unsigned long ring_bytes;
+};
+
+/*
+ * An output backend. The audio thread opens it in the ring's format, which
+ * sets the period it should be fed in, and hands it frames whenever avail()
+ * reports room. Calls that return a count use negative errno values for
+ * errors, with -EPIPE meaning an underrun. Any other error from avail(),
+ * delay() or write() means the output is unusable: it is closed and
+ * reopened a second later.
+ */
+struct audio_output {
+	const char *name;
+
+	int  (*open)(const char *arg, int rate, int channels, size_t *period);
+	void (*close)(void);
+
+	long (*avail)(void);
+	long (*delay)(void);
+	long (*write)(const int16_t *frames, size_t n);
+	int  (*recover)(int err);
+	void (*drop)(void);
+
+	/* Descriptors that signal room; backends without any return 0 */
+	int  (*poll_fds)(struct pollfd *fds, int max);
+	int  (*poll_revents)(struct pollfd *fds, int n);
+};
+
+extern const struct audio_output alsa_output;
+extern const struct audio_output null_output;
+extern const struct audio_output wav_output;
+extern const struct audio_output pipe_output;
+
 void audio_start();
 void audio_stop();
 
-int  audio_init();
+int  audio_init(const struct audio_config *config);
 int  audio_buffered();
+int  audio_stutter();
 int  audio_push(const void *frames, size_t n, int rate, int channels, int bits);
 void audio_flush();
 
+/*
+ * Position clock: audio_mark_track() makes the next frame pushed the start
+ * of a track and returns a mark number for it; audio_track_reached() is
+ * that number once every frame before the mark has gone to the output, so
+ * the track is the one being played. audio_position_ms() says how much of
+ * the track being played has been heard. The latter two are a few loads
+ * and may be called from any thread.
+ */
+unsigned int audio_mark_track();
+unsigned int audio_track_reached();
+long audio_position_ms();
+void audio_get_stats(struct audio_stats *st);
+int  audio_format_stats(char *buf, size_t len);
+
 #endif
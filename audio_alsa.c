@@ -0,0 +1,254 @@
+#include <asoundlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "audio.h"
+#include "log.h"
+
+static snd_pcm_t *pcm;
+static snd_pcm_uframes_t pcm_period;
+
+static snd_pcm_t *alsa_open(const char *dev, int rate, int channels)
+{
+	snd_pcm_hw_params_t *hwp;
+	snd_pcm_sw_params_t *swp;
+	snd_pcm_t *h;
+	int r, dir;
+
+	snd_pcm_uframes_t period_size_min;
+	snd_pcm_uframes_t period_size_max;
+	snd_pcm_uframes_t buffer_size_min;
+	snd_pcm_uframes_t buffer_size_max;
+	snd_pcm_uframes_t period_size;
+	snd_pcm_uframes_t buffer_size;
+
+	r = snd_pcm_open(&h, dev, SND_PCM_STREAM_PLAYBACK, 0);
+	if (r < 0) {
+		log_error("audio: Unable to open %s (%s)", dev, snd_strerror(r));
+		return NULL;
+	}
+
+	hwp = alloca(snd_pcm_hw_params_sizeof());
+	memset(hwp, 0, snd_pcm_hw_params_sizeof());
+	r = snd_pcm_hw_params_any(h, hwp);
+	if (r < 0) {
+		log_error("audio: No configurations available for %s (%s)",
+		          dev, snd_strerror(r));
+		snd_pcm_close(h);
+		return NULL;
+	}
+
+	r = snd_pcm_hw_params_set_rate_resample(h, hwp, 1);
+	if (r < 0) {
+		log_error("audio: Unable to enable resampling (%s)", snd_strerror(r));
+		snd_pcm_close(h);
+		return NULL;
+	}
+
+	r = snd_pcm_hw_params_set_access(h, hwp, SND_PCM_ACCESS_RW_INTERLEAVED);
+	if (r < 0) {
+		log_error("audio: Unable to set interleaved access (%s)", snd_strerror(r));
+		snd_pcm_close(h);
+		return NULL;
+	}
+
+	r = snd_pcm_hw_params_set_format(h, hwp, SND_PCM_FORMAT_S16_LE);
+	if (r < 0) {
+		log_error("audio: Unable to set format S16_LE (%s)", snd_strerror(r));
+		snd_pcm_close(h);
+		return NULL;
+	}
+
+	r = snd_pcm_hw_params_set_rate(h, hwp, rate, 0);
+	if (r < 0) {
+		log_error("audio: Unable to set rate %d Hz (%s)", rate, snd_strerror(r));
+		snd_pcm_close(h);
+		return NULL;
+	}
+
+	r = snd_pcm_hw_params_set_channels(h, hwp, channels);
+	if (r < 0) {
+		log_error("audio: Unable to set %d channels (%s)", channels, snd_strerror(r));
+		snd_pcm_close(h);
+		return NULL;
+	}
+
+	/* Configurue period */
+
+	dir = 0;
+	snd_pcm_hw_params_get_period_size_min(hwp, &period_size_min, &dir);
+	dir = 0;
+	snd_pcm_hw_params_get_period_size_max(hwp, &period_size_max, &dir);
+
+	period_size = 1024;
+
+	dir = 0;
+	r = snd_pcm_hw_params_set_period_size_near(h, hwp, &period_size, &dir);
+	if (r < 0) {
+		log_error("audio: Unable to set period size %lu (%s)",
+		          period_size, snd_strerror(r));
+		snd_pcm_close(h);
+		return NULL;
+	}
+
+	dir = 0;
+	r = snd_pcm_hw_params_get_period_size(hwp, &period_size, &dir);
+	if (r < 0) {
+		log_error("audio: Unable to get period size (%s)",
+		          snd_strerror(r));
+		snd_pcm_close(h);
+		return NULL;
+	}
+	pcm_period = period_size;
+
+	/* Configurue buffer size */
+
+	snd_pcm_hw_params_get_buffer_size_min(hwp, &buffer_size_min);
+	snd_pcm_hw_params_get_buffer_size_max(hwp, &buffer_size_max);
+	buffer_size = period_size * 4;
+
+	dir = 0;
+	r = snd_pcm_hw_params_set_buffer_size_near(h, hwp, &buffer_size);
+	if (r < 0) {
+		log_error("audio: Unable to set buffer size %lu (%s)",
+		          buffer_size, snd_strerror(r));
+		snd_pcm_close(h);
+		return NULL;
+	}
+
+	r = snd_pcm_hw_params_get_buffer_size(hwp, &buffer_size);
+	if (r < 0) {
+		log_error("audio: Unable to get buffer size (%s)",
+		          snd_strerror(r));
+		snd_pcm_close(h);
+		return NULL;
+	}
+
+	/* write the hw params */
+	r = snd_pcm_hw_params(h, hwp);
+	if (r < 0) {
+		log_error("audio: Unable to configure hardware parameters (%s)",
+		          snd_strerror(r));
+		snd_pcm_close(h);
+		return NULL;
+	}
+
+	/*
+	 * Software parameters
+	 */
+	swp = alloca(snd_pcm_sw_params_sizeof());
+	memset(swp, 0, snd_pcm_sw_params_sizeof());
+	snd_pcm_sw_params_current(h, swp);
+
+	r = snd_pcm_sw_params_set_avail_min(h, swp, period_size);
+	if (r < 0) {
+		log_error("audio: Unable to configure wakeup threshold (%s)",
+		          snd_strerror(r));
+		snd_pcm_close(h);
+		return NULL;
+	}
+
+	r = snd_pcm_sw_params_set_start_threshold(h, swp, 0);
+	if (r < 0) {
+		log_error("audio: Unable to configure start threshold (%s)",
+		          snd_strerror(r));
+		snd_pcm_close(h);
+		return NULL;
+	}
+
+	r = snd_pcm_sw_params(h, swp);
+	if (r < 0) {
+		log_error("audio: Cannot set soft parameters (%s)",
+		          snd_strerror(r));
+		snd_pcm_close(h);
+		return NULL;
+	}
+
+	r = snd_pcm_prepare(h);
+	if (r < 0) {
+		log_error("audio: Cannot prepare audio for playback (%s)",
+		          snd_strerror(r));
+		snd_pcm_close(h);
+		return NULL;
+	}
+
+	return h;
+}
+
+static int alsa_output_open(const char *arg, int rate, int channels, size_t *period)
+{
+	pcm = alsa_open(arg ? arg : "default", rate, channels);
+	if (!pcm)
+		return -1;
+
+	*period = pcm_period;
+	return 0;
+}
+
+static void alsa_output_close()
+{
+	snd_pcm_close(pcm);
+	pcm = NULL;
+}
+
+static long alsa_output_avail()
+{
+	return snd_pcm_avail_update(pcm);
+}
+
+static long alsa_output_delay()
+{
+	snd_pcm_sframes_t d;
+	int r;
+
+	r = snd_pcm_delay(pcm, &d);
+	return r < 0 ? r : d;
+}
+
+static long alsa_output_write(const int16_t *frames, size_t n)
+{
+	return snd_pcm_writei(pcm, frames, n);
+}
+
+static int alsa_output_recover(int err)
+{
+	return snd_pcm_prepare(pcm);
+}
+
+static void alsa_output_drop()
+{
+	snd_pcm_drop(pcm);
+	snd_pcm_prepare(pcm);
+}
+
+static int alsa_output_poll_fds(struct pollfd *fds, int max)
+{
+	int n = snd_pcm_poll_descriptors_count(pcm);
+
+	if (n <= 0 || n > max)
+		return 0;
+
+	return snd_pcm_poll_descriptors(pcm, fds, n);
+}
+
+static int alsa_output_poll_revents(struct pollfd *fds, int n)
+{
+	unsigned short revents = 0;
+
+	snd_pcm_poll_descriptors_revents(pcm, fds, n, &revents);
+	return revents & POLLERR ? -EPIPE : 0;
+}
+
+const struct audio_output alsa_output = {
+	.name         = "alsa",
+	.open         = alsa_output_open,
+	.close        = alsa_output_close,
+	.avail        = alsa_output_avail,
+	.delay        = alsa_output_delay,
+	.write        = alsa_output_write,
+	.recover      = alsa_output_recover,
+	.drop         = alsa_output_drop,
+	.poll_fds     = alsa_output_poll_fds,
+	.poll_revents = alsa_output_poll_revents,
+};
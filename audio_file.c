@@ -0,0 +1,211 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "audio.h"
+#include "log.h"
+
+/*
+ * Raw little-endian PCM to a file or pipe, optionally behind a WAV header.
+ * Writes block, so a pipe is drained at its reader's pace and a file as
+ * fast as the disk allows. Only the first open truncates the file; later
+ * ones, after a format change or a failed write, carry on at its end.
+ * audio_init() only takes a wav output with a fixed format, since one
+ * header has to describe the whole recording.
+ */
+#define FILE_PERIOD 4096
+
+static int file_fd = -1;
+static int file_opened;
+static int file_wav;
+static int file_frame;
+static uint32_t file_bytes;
+
+static void put_le(unsigned char *p, uint32_t v, int n)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+		p[i] = v >> (8 * i);
+}
+
+static int write_all(const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t r;
+
+	while (len) {
+		r = write(file_fd, p, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+static void wav_header(unsigned char *h, int rate, int channels, uint32_t bytes)
+{
+	memcpy(h, "RIFF", 4);
+	put_le(h + 4, 36 + bytes, 4);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	put_le(h + 16, 16, 4);
+	put_le(h + 20, 1, 2);
+	put_le(h + 22, channels, 2);
+	put_le(h + 24, rate, 4);
+	put_le(h + 28, rate * channels * 2, 4);
+	put_le(h + 32, channels * 2, 2);
+	put_le(h + 34, 16, 2);
+	memcpy(h + 36, "data", 4);
+	put_le(h + 40, bytes, 4);
+}
+
+static int file_open(const char *path, int wav, int rate, int channels, size_t *period)
+{
+	unsigned char h[44];
+	off_t end = 0;
+
+	if (!path || strcmp(path, "-") == 0) {
+		if (wav) {
+			log_error("audio: The wav output needs a file name");
+			return -1;
+		}
+		file_fd = STDOUT_FILENO;
+	} else {
+		file_fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC | (file_opened ? 0 : O_TRUNC), 0644);
+		if (file_fd < 0) {
+			log_error("audio: Unable to open %s (%s)", path, strerror(errno));
+			return -1;
+		}
+		end = file_opened ? lseek(file_fd, 0, SEEK_END) : 0;
+		if (end < 0 && errno != ESPIPE) {
+			log_error("audio: Unable to append to %s (%s)", path, strerror(errno));
+			close(file_fd);
+			file_fd = -1;
+			return -1;
+		}
+	}
+
+	file_wav = wav;
+	file_frame = channels * sizeof(int16_t);
+
+	/* A reopened wav keeps its header; drop any frame a failed write cut short */
+	if (wav && file_opened && end >= 44) {
+		file_bytes = (end - 44) - (end - 44) % file_frame;
+		lseek(file_fd, 44 + file_bytes, SEEK_SET);
+	} else if (wav) {
+		file_bytes = 0;
+		wav_header(h, rate, channels, 0);
+		if (write_all(h, sizeof(h)) < 0) {
+			close(file_fd);
+			file_fd = -1;
+			return -1;
+		}
+	}
+
+	file_opened = 1;
+	*period = FILE_PERIOD;
+	return 0;
+}
+
+static int wav_output_open(const char *arg, int rate, int channels, size_t *period)
+{
+	return file_open(arg, 1, rate, channels, period);
+}
+
+static int pipe_output_open(const char *arg, int rate, int channels, size_t *period)
+{
+	return file_open(arg, 0, rate, channels, period);
+}
+
+static void file_output_close()
+{
+	unsigned char size[4];
+
+	/* Now that the length is known, fill it in */
+	if (file_wav) {
+		put_le(size, 36 + file_bytes, 4);
+		if (pwrite(file_fd, size, 4, 4) == 4) {
+			put_le(size, file_bytes, 4);
+			pwrite(file_fd, size, 4, 40);
+		}
+	}
+
+	if (file_fd != STDOUT_FILENO)
+		close(file_fd);
+	file_fd = -1;
+}
+
+static long file_output_avail()
+{
+	return FILE_PERIOD;
+}
+
+static long file_output_delay()
+{
+	return 0;
+}
+
+static long file_output_write(const int16_t *frames, size_t n)
+{
+	int r;
+
+	/* A reader that went away is not an underrun */
+	r = write_all(frames, n * file_frame);
+	if (r < 0)
+		return r == -EPIPE ? -ENOTCONN : r;
+
+	file_bytes += n * file_frame;
+	return n;
+}
+
+static int file_output_recover(int err)
+{
+	return 0;
+}
+
+static void file_output_drop()
+{
+}
+
+static int file_output_poll_fds(struct pollfd *fds, int max)
+{
+	return 0;
+}
+
+static int file_output_poll_revents(struct pollfd *fds, int n)
+{
+	return 0;
+}
+
+const struct audio_output wav_output = {
+	.name         = "wav",
+	.open         = wav_output_open,
+	.close        = file_output_close,
+	.avail        = file_output_avail,
+	.delay        = file_output_delay,
+	.write        = file_output_write,
+	.recover      = file_output_recover,
+	.drop         = file_output_drop,
+	.poll_fds     = file_output_poll_fds,
+	.poll_revents = file_output_poll_revents,
+};
+
+const struct audio_output pipe_output = {
+	.name         = "pipe",
+	.open         = pipe_output_open,
+	.close        = file_output_close,
+	.avail        = file_output_avail,
+	.delay        = file_output_delay,
+	.write        = file_output_write,
+	.recover      = file_output_recover,
+	.drop         = file_output_drop,
+	.poll_fds     = file_output_poll_fds,
+	.poll_revents = file_output_poll_revents,
+};
@@ -0,0 +1,114 @@
+#include <string.h>
+#include <time.h>
+
+#include "audio.h"
+
+/*
+ * Discards everything. By default it consumes frames at the stream's rate
+ * through an imaginary device buffer; "null:fast" takes them as fast as
+ * they come, for measuring everything upstream of the output.
+ */
+#define NULL_PERIOD 1024
+#define NULL_BUFFER (NULL_PERIOD * 4)
+
+static int null_fast;
+static int null_rate;
+static struct timespec null_start;
+static uint64_t null_written;
+
+static int null_output_open(const char *arg, int rate, int channels, size_t *period)
+{
+	null_fast = arg && strcmp(arg, "fast") == 0;
+	null_rate = rate;
+	null_written = 0;
+	clock_gettime(CLOCK_MONOTONIC, &null_start);
+
+	*period = NULL_PERIOD;
+	return 0;
+}
+
+static void null_output_close()
+{
+}
+
+/* Frames still in the imaginary device buffer */
+static uint64_t null_queued()
+{
+	struct timespec now;
+	uint64_t played;
+	time_t sec;
+	long nsec;
+
+	if (null_fast)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	sec = now.tv_sec - null_start.tv_sec;
+	nsec = now.tv_nsec - null_start.tv_nsec;
+	if (nsec < 0) {
+		--sec;
+		nsec += 1000000000L;
+	}
+
+	/* Whole seconds and the rest apart, so a long stream can't overflow */
+	played = (uint64_t) sec * null_rate + (uint64_t) nsec * null_rate / 1000000000ULL;
+
+	/* Ran dry: the imaginary device idles and starts over */
+	if (played >= null_written) {
+		null_start = now;
+		null_written = 0;
+		return 0;
+	}
+
+	return null_written - played;
+}
+
+static long null_output_avail()
+{
+	return NULL_BUFFER - null_queued();
+}
+
+static long null_output_delay()
+{
+	return null_queued();
+}
+
+static long null_output_write(const int16_t *frames, size_t n)
+{
+	null_written += n;
+	return n;
+}
+
+static int null_output_recover(int err)
+{
+	return 0;
+}
+
+static void null_output_drop()
+{
+	null_written = 0;
+	clock_gettime(CLOCK_MONOTONIC, &null_start);
+}
+
+static int null_output_poll_fds(struct pollfd *fds, int max)
+{
+	return 0;
+}
+
+static int null_output_poll_revents(struct pollfd *fds, int n)
+{
+	return 0;
+}
+
+const struct audio_output null_output = {
+	.name         = "null",
+	.open         = null_output_open,
+	.close        = null_output_close,
+	.avail        = null_output_avail,
+	.delay        = null_output_delay,
+	.write        = null_output_write,
+	.recover      = null_output_recover,
+	.drop         = null_output_drop,
+	.poll_fds     = null_output_poll_fds,
+	.poll_revents = null_output_poll_revents,
+};
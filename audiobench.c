@@ -0,0 +1,286 @@
+/*
+ * Audio path microbenchmark: pushes a test tone through audio_push() into
+ * an output (null:fast by default) and prints one JSON object per run.
+ *
+ * Every combination of the given chunk sizes, rates and channel counts is
+ * a run of its own, in a fresh process, so runs don't share rings, stats
+ * or allocations. A run pushes a fixed amount of audio and ends once the
+ * audio thread has written all of it.
+ *
+ * Reported per run: frames written per wall second, audio_push() calls and
+ * their latency (ns, log2 buckets as in hist.h), allocations made while
+ * running, and CPU time per second of audio for the process, the producer
+ * and (the rest, essentially) the audio thread.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "audio.h"
+#include "hist.h"
+
+#define MAX_RUNS  16
+
+struct run {
+	int chunk;
+	int rate;
+	int channels;
+};
+
+static struct audio_config config = { .output = "null:fast" };
+static double seconds = 10;
+static double pace;              /* multiple of real time, 0 = as accepted */
+static int retry_us = 1000;      /* wait after a refused push */
+
+/*
+ * Count allocations by wrapping glibc's allocator. posix_memalign() is left
+ * alone; only audio_init() uses it.
+ */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static atomic_ulong allocs;
+
+void *malloc(size_t n)
+{
+	atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+	return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n)
+{
+	atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+	return __libc_realloc(p, n);
+}
+
+static uint64_t clock_ns(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns)
+{
+	struct timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static uint64_t rusage_ns(const struct rusage *ru)
+{
+	return (uint64_t) (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000000ULL +
+	       (uint64_t) (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) * 1000ULL;
+}
+
+static int parse_list(char *arg, int *v, int max)
+{
+	char *item, *save;
+	int n = 0;
+
+	for (item = strtok_r(arg, ",", &save); item && n < max; item = strtok_r(NULL, ",", &save))
+		if ((v[n] = atoi(item)) > 0)
+			++n;
+
+	return n;
+}
+
+/*
+ * One second of tone, so any chunk can be taken from it without a seam.
+ */
+static int16_t *make_tone(int rate, int channels)
+{
+	int16_t *tone, s;
+	int i, c;
+
+	tone = malloc((size_t) rate * channels * sizeof(*tone));
+	if (!tone)
+		abort();
+
+	for (i = 0; i < rate; ++i) {
+		s = (int16_t) (8192 * sin(2 * M_PI * 440 * i / rate));
+		for (c = 0; c < channels; ++c)
+			tone[i * channels + c] = s;
+	}
+
+	return tone;
+}
+
+static void run(const struct run *r)
+{
+	struct audio_stats st;
+	struct rusage ru0, ru1;
+	struct hist push = { 0 };
+	uint64_t start, end, t, cpu0, cpu1, total, pushed = 0, due;
+	unsigned long calls = 0, refused = 0, allocs0, allocs1, out_frames;
+	int16_t *tone;
+	size_t n, off;
+	int got, out_rate;
+
+	if (audio_init(&config) < 0) {
+		fprintf(stderr, "Failed to initialize audio\n");
+		exit(EXIT_FAILURE);
+	}
+
+	tone = make_tone(r->rate, r->channels);
+	total = (uint64_t) (seconds * r->rate);
+	out_rate = config.rate ? config.rate : r->rate;
+
+	audio_start();
+
+	getrusage(RUSAGE_SELF, &ru0);
+	cpu0 = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	allocs0 = atomic_load(&allocs);
+	start = clock_ns(CLOCK_MONOTONIC);
+
+	while (pushed < total) {
+		off = pushed % r->rate;
+		n = r->chunk;
+		if (n > total - pushed)
+			n = total - pushed;
+		if (n > r->rate - off)
+			n = r->rate - off;
+
+		t = clock_ns(CLOCK_MONOTONIC);
+		got = audio_push(tone + off * r->channels, n, r->rate, r->channels, 16);
+		hist_add(&push, clock_ns(CLOCK_MONOTONIC) - t);
+		++calls;
+
+		pushed += got;
+		if ((size_t) got < n) {
+			++refused;
+			sleep_ns(retry_us * 1000ULL);
+		} else if (pace > 0) {
+			due = start + (uint64_t) (pushed * 1e9 / (r->rate * pace));
+			t = clock_ns(CLOCK_MONOTONIC);
+			if (due > t)
+				sleep_ns(due - t);
+		}
+	}
+	cpu1 = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+	/* Wait for the audio thread to write everything out, within reason */
+	out_frames = (uint64_t) total * out_rate / r->rate;
+	t = clock_ns(CLOCK_MONOTONIC) + 10000000000ULL;
+	do {
+		sleep_ns(100000);
+		audio_get_stats(&st);
+	} while ((audio_buffered() > 0 || st.frames + out_rate / 100 < out_frames) &&
+	         clock_ns(CLOCK_MONOTONIC) < t);
+
+	end = clock_ns(CLOCK_MONOTONIC);
+	allocs1 = atomic_load(&allocs);
+	getrusage(RUSAGE_SELF, &ru1);
+
+	audio_stop();
+
+	double wall = (end - start) / 1e9;
+	double audio = (double) pushed / r->rate;
+	double cpu = (rusage_ns(&ru1) - rusage_ns(&ru0)) / 1e6;
+	double producer = (cpu1 - cpu0) / 1e6;
+
+	printf("{\"output\":\"%s\",\"chunk\":%d,\"rate\":%d,\"channels\":%d,"
+	       "\"out_rate\":%d,\"pace\":%g,\"audio_s\":%.3f,\"wall_s\":%.3f,"
+	       "\"frames\":%lu,\"frames_per_s\":%.0f,"
+	       "\"push_calls\":%lu,\"push_refused\":%lu,"
+	       "\"push_ns\":{\"avg\":%lu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"max\":%lu},"
+	       "\"allocs\":%lu,\"allocs_per_s\":%.1f,"
+	       "\"cpu_ms_per_audio_s\":%.3f,\"producer_cpu_ms_per_audio_s\":%.3f,"
+	       "\"consumer_cpu_ms_per_audio_s\":%.3f,"
+	       "\"writes\":%lu,\"wakeups\":%lu,\"xruns\":%lu,"
+	       "\"voluntary_switches\":%ld,\"involuntary_switches\":%ld}\n",
+	       config.output, r->chunk, r->rate, r->channels, out_rate, pace, audio, wall,
+	       st.frames, st.frames / wall, calls, refused,
+	       calls ? atomic_load(&push.sum) / calls : 0,
+	       hist_percentile(&push, 50), hist_percentile(&push, 90),
+	       hist_percentile(&push, 99), atomic_load(&push.max),
+	       allocs1 - allocs0, (allocs1 - allocs0) / wall,
+	       cpu / audio, producer / audio, (cpu - producer) / audio,
+	       st.writes, st.wakeups, st.xruns,
+	       ru1.ru_nvcsw - ru0.ru_nvcsw, ru1.ru_nivcsw - ru0.ru_nivcsw);
+	fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s [-o output] [-k chunks] [-r rates] [-c channels] [-R rate]\n"
+	        "          [-C channels] [-b low:high] [-d seconds] [-p pace] [-w us]\n"
+	        "\n"
+	        "  -k, -r, -c  comma separated; every combination is a run\n"
+	        "  -R, -C      fixed output format, as smd -r and -c\n"
+	        "  -p          producer pace as a multiple of real time, 0 = as accepted\n"
+	        "  -w          wait after a refused push (1000 us)\n",
+	        prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	int chunks[MAX_RUNS] = { 1024 }, rates[MAX_RUNS] = { 44100 }, chans[MAX_RUNS] = { 2 };
+	int nchunks = 1, nrates = 1, nchans = 1, i, j, k, opt, status, failed = 0;
+	struct run r;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "o:k:r:c:R:C:b:d:p:w:")) != -1) {
+		switch (opt) {
+		case 'o': config.output = optarg; break;
+		case 'k': nchunks = parse_list(optarg, chunks, MAX_RUNS); break;
+		case 'r': nrates = parse_list(optarg, rates, MAX_RUNS); break;
+		case 'c': nchans = parse_list(optarg, chans, MAX_RUNS); break;
+		case 'R': config.rate = atoi(optarg); break;
+		case 'C': config.channels = atoi(optarg); break;
+		case 'b':
+			if (sscanf(optarg, "%d:%d", &config.buffer_min_ms, &config.buffer_max_ms) != 2)
+				usage(argv[0]);
+			break;
+		case 'd': seconds = atof(optarg); break;
+		case 'p': pace = atof(optarg); break;
+		case 'w': retry_us = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (!nchunks || !nrates || !nchans || seconds <= 0 || pace < 0)
+		usage(argv[0]);
+
+	for (i = 0; i < nchunks; ++i) {
+		for (j = 0; j < nrates; ++j) {
+			for (k = 0; k < nchans; ++k) {
+				r.chunk = chunks[i];
+				r.rate = rates[j];
+				r.channels = chans[k];
+
+				pid = fork();
+				if (pid == 0) {
+					run(&r);
+					exit(EXIT_SUCCESS);
+				}
+
+				if (pid < 0 || waitpid(pid, &status, 0) < 0 ||
+				    !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+					failed = 1;
+			}
+		}
+	}
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -9,32 +9,36 @@
 #include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <netinet/ip.h>
 
-#define QUIT   0
-#define QUEUE  1
-#define LIST   2
-#define NEXT   3
-#define CLEAR  4
-#define STATUS 5
+#include "proto.h"
+#include "status.h"
+
+/* The client calls PUSH "list" */
+#define LIST   PUSH
+#define WATCH  SUBSCRIBE
+#define BATCH  14
+#define PEEK   15
 
 const char *commands[] = {
-  "quit", "queue", "list", "next", "clear", "status", NULL
+  "quit", "queue", "list", "next", "clear", "status", "stats",
+  "remove", "move", "shuffle", "tracks", "insert", "watch", "trace", "batch", "peek", NULL
 };
 
-static char socket_buf[1024];
+static char socket_buf[PROTO_MAX + 1];
 
 static int server_recv(int fd, char **payload, int *len)
 {
   int l;
 
-  l = recv(fd, &socket_buf, 1024, 0);
+  l = recv(fd, &socket_buf, PROTO_MAX, 0);
   if (l <= 0)
     return -1;
 
-  *len = socket_buf[1] << 8 | socket_buf[2];
-  if (*len > l || *len >= 1020)
+  *len = (unsigned char) socket_buf[1] << 8 | (unsigned char) socket_buf[2];
+  if (*len + 3 > l)
     return -1;
 
   socket_buf[*len + 3] = '\0';
@@ -45,19 +49,121 @@ static int server_recv(int fd, char **payload, int *len)
 
 static int server_send(int fd, char type, char *payload, int len)
 {
-  struct sockaddr_in addr;
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(1025);
-  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-
   socket_buf[0] = type;
-  socket_buf[1] = (char) ((len >> 8) & 0xFF00);
+  socket_buf[1] = (char) ((len >> 8) & 0xFF);
   socket_buf[2] = (char) (len & 0xFF);
 
   if (len)
     strncpy(socket_buf + 3, payload, len);
 
-  return sendto(fd, socket_buf, len + 3, 0, (struct sockaddr *) &addr, sizeof(struct sockaddr_in));
+  return send(fd, socket_buf, len + 3, 0);
+}
+
+/*
+ * UDP to the daemon's port, or its SOCK_SEQPACKET socket when a path is
+ * given; both keep one message per send.
+ */
+static int connect_server(const char *path)
+{
+  struct sockaddr_in addr;
+  struct sockaddr_un un;
+  int fd;
+
+  if (path) {
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strncpy(un.sun_path, path, sizeof(un.sun_path) - 1);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *) &un, sizeof(un)) < 0) {
+      perror(path);
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(1025);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+      perror("connect");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (fd < 0) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+
+  return fd;
+}
+
+/*
+ * Subscribe and print events as they arrive, until the daemon goes away.
+ */
+static int watch(int fd, const char *events, const char *interval)
+{
+  static const char *names[] = { "track", "queue", "buffer", "position" };
+  int l, len, ev, i;
+  char buf[64];
+
+  /* The daemon refuses these, but a legacy message gets no reply to say so */
+  if (atoi(events) & ~PROTO_EV_ALL) {
+    fprintf(stderr, "Unknown events in mask %s\n", events);
+    return EXIT_FAILURE;
+  }
+
+  len = snprintf(buf, sizeof(buf), "%s %s", events, interval);
+  server_send(fd, SUBSCRIBE, buf, len);
+
+  while ((l = recv(fd, socket_buf, PROTO_MAX, 0)) > 0) {
+    if (l < 5 || (unsigned char) socket_buf[0] != PROTO_EVENT)
+      continue;
+
+    ev = (unsigned char) socket_buf[2];
+    len = proto_get16((unsigned char *) socket_buf + 3);
+    if (len > l - 5)
+      continue;
+
+    for (i = 0; i < 4 && ev != 1 << i; ++i)
+      ;
+    printf("%s: %.*s\n", i < 4 ? names[i] : "?", len, socket_buf + 5);
+    fflush(stdout);
+  }
+
+  return EXIT_FAILURE;
+}
+
+/*
+ * Read the daemon's status page, once or every ms milliseconds. No socket
+ * and, past the first mapping, no syscalls.
+ */
+static int peek(int ms)
+{
+  const struct status_page *page;
+  struct status st;
+  struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+  page = status_open(STATUS_NAME);
+  if (!page) {
+    fprintf(stderr, "No status page, is smd running?\n");
+    return EXIT_FAILURE;
+  }
+
+  do {
+    status_read(page, &st);
+    if (st.playing)
+      printf("%s - %s %02u:%02u/%02u:%02u", st.artist, st.track,
+             st.position_ms / 60000, st.position_ms / 1000 % 60,
+             st.duration_ms / 60000, st.duration_ms / 1000 % 60);
+    else
+      printf("stopped");
+    printf(", %u queued, %u ms buffered, %lu xruns\n", st.queue_len, st.buffer_ms, st.xruns);
+    fflush(stdout);
+  } while (ms > 0 && nanosleep(&ts, NULL) == 0);
+
+  return EXIT_SUCCESS;
 }
 
 static int parse_command(char *cmd)
@@ -71,20 +177,121 @@ static int parse_command(char *cmd)
   return -1;
 }
 
+static unsigned char batch_buf[PROTO_MAX];
+
+static int send_batch(int fd, int n, int len)
+{
+  batch_buf[0] = PROTO_MAGIC;
+  batch_buf[1] = PROTO_VERSION;
+  proto_put16(batch_buf + 2, n);
+
+  return send(fd, batch_buf, len, 0);
+}
+
+/*
+ * Print replies until every command up to seq has been answered, or the
+ * daemon has been quiet for a second. Returns the number still missing.
+ */
+static int recv_batch(int fd, uint32_t seq, uint32_t *acked)
+{
+  static const char *statuses[] = { "ok", "error", "unknown", "bad version", "full" };
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  unsigned char *p, *end;
+  uint32_t s;
+  int l, n, len;
+
+  while (*acked < seq && poll(&pfd, 1, 1000) > 0) {
+    l = recv(fd, batch_buf, sizeof(batch_buf), 0);
+    if (l < PROTO_HEADER || batch_buf[0] != PROTO_MAGIC)
+      continue;
+
+    n = proto_get16(batch_buf + 2);
+    p = batch_buf + PROTO_HEADER;
+    end = batch_buf + l;
+    while (n-- > 0 && end - p >= PROTO_RECORD) {
+      s = proto_get32(p);
+      len = proto_get16(p + 5);
+      if (len > end - p - PROTO_RECORD)
+        break;
+
+      printf("%u %s", s, p[4] <= PROTO_FULL ? statuses[p[4]] : "?");
+      if (len)
+        printf(" %.*s", len, p + PROTO_RECORD);
+      printf("\n");
+
+      if (s >= *acked)
+        *acked = s + 1;
+      p += PROTO_RECORD + len;
+    }
+  }
+
+  return seq - *acked;
+}
+
+/*
+ * Read "command [args]" lines from stdin and send them as batches, each
+ * as large as a datagram allows, then print the acks.
+ */
+static int batch(int fd)
+{
+  char line[1024], *arg;
+  uint32_t seq = 0, acked = 0;
+  int n = 0, o = PROTO_HEADER, type, len;
+
+  while (fgets(line, sizeof(line), stdin)) {
+    line[strcspn(line, "\n")] = '\0';
+    arg = line + strcspn(line, " ");
+    if (*arg)
+      *arg++ = '\0';
+
+    type = parse_command(line);
+    if (type < 0 || type == BATCH) {
+      fprintf(stderr, "Unknown command: %s\n", line);
+      continue;
+    }
+
+    len = strlen(arg);
+    if (o + PROTO_RECORD + len > PROTO_MAX) {
+      send_batch(fd, n, o);
+      n = 0;
+      o = PROTO_HEADER;
+    }
+
+    proto_put32(batch_buf + o, seq++);
+    batch_buf[o + 4] = type;
+    proto_put16(batch_buf + o + 5, len);
+    memcpy(batch_buf + o + PROTO_RECORD, arg, len);
+    o += PROTO_RECORD + len;
+    ++n;
+  }
+
+  if (n)
+    send_batch(fd, n, o);
+
+  return recv_batch(fd, seq, &acked) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv)
 {
-  char *payload;
+  char buf[1000], *payload;
   int len;
 
-  if (argc < 1)
-    return EXIT_FAILURE;
+  const char *path = NULL;
 
-  int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  if (fd < 0) {
-    perror("socket");
-    exit(EXIT_FAILURE);
+  if (argc >= 3 && strcmp(argv[1], "-S") == 0) {
+    path = argv[2];
+    argv += 2;
+    argc -= 2;
   }
 
+  if (argc < 2)
+    return EXIT_FAILURE;
+
+  if (parse_command(argv[1]) == PEEK)
+    return peek(argc >= 3 ? atoi(argv[2]) : 0);
+
+  int fd = connect_server(path);
+
   switch (parse_command(argv[1])) {
   case QUIT:
     server_send(fd, QUIT, NULL, 0);
@@ -117,6 +324,68 @@ int main(int argc, char **argv)
     }
     break;
 
+  case STATS:
+    server_send(fd, STATS, NULL, 0);
+    if (server_recv(fd, &payload, &len) == 0) {
+      printf("%s", payload);
+    }
+    break;
+
+  case TRACE:
+    server_send(fd, TRACE, NULL, 0);
+    if (server_recv(fd, &payload, &len) == 0) {
+      printf("%s\n", payload);
+    }
+    break;
+
+  case REMOVE:
+    if (argc >= 3)
+      server_send(fd, REMOVE, argv[2], strlen(argv[2]));
+    break;
+
+  case MOVE:
+    if (argc >= 4) {
+      len = snprintf(buf, sizeof(buf), "%s %s", argv[2], argv[3]);
+      server_send(fd, MOVE, buf, len);
+    }
+    break;
+
+  case SHUFFLE:
+    server_send(fd, SHUFFLE, NULL, 0);
+    break;
+
+  case QLIST:
+    len = snprintf(buf, sizeof(buf), "%s %s", argc >= 3 ? argv[2] : "0",
+                   argc >= 4 ? argv[3] : "20");
+    server_send(fd, QLIST, buf, len);
+    if (server_recv(fd, &payload, &len) == 0) {
+      printf("%s", payload);
+    }
+    break;
+
+  case INSERT:
+    if (argc >= 4) {
+      len = snprintf(buf, sizeof(buf), "%s %s", argv[2], argv[3]);
+      server_send(fd, INSERT, buf, len);
+    }
+    break;
+
+  case WATCH:
+    /* Events only go to connected clients; over UDP nothing would ever come */
+    if (!path) {
+      fprintf(stderr, "watch needs the daemon's unix socket, see -S\n");
+      close(fd);
+      return EXIT_FAILURE;
+    }
+    len = watch(fd, argc >= 3 ? argv[2] : "15", argc >= 4 ? argv[3] : "1000");
+    close(fd);
+    return len;
+
+  case BATCH:
+    len = batch(fd);
+    close(fd);
+    return len;
+
   default:
     break;
   }
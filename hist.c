@@ -0,0 +1,56 @@
+#include <stdio.h>
+
+#include "hist.h"
+
+unsigned long hist_count(struct hist *h)
+{
+	unsigned long n = 0;
+	int b;
+
+	for (b = 0; b < HIST_BUCKETS; ++b)
+		n += atomic_load_explicit(&h->count[b], memory_order_relaxed);
+
+	return n;
+}
+
+/*
+ * Upper bound of the bucket holding the pct:th percentile, capped at the
+ * largest value seen.
+ */
+unsigned long hist_percentile(struct hist *h, int pct)
+{
+	unsigned long n, seen = 0, max;
+	int b;
+
+	n = hist_count(h);
+	if (!n)
+		return 0;
+
+	max = atomic_load_explicit(&h->max, memory_order_relaxed);
+
+	for (b = 0; b < HIST_BUCKETS; ++b) {
+		seen += atomic_load_explicit(&h->count[b], memory_order_relaxed);
+		if (seen * 100 >= n * pct)
+			break;
+	}
+
+	if (b == 0)
+		return 0;
+
+	return b < 64 && (1UL << b) - 1 < max ? (1UL << b) - 1 : max;
+}
+
+/*
+ * One line: name n=<count> avg=<mean> p50= p90= p99= max=
+ */
+int hist_format(struct hist *h, const char *name, char *buf, size_t len)
+{
+	unsigned long n = hist_count(h);
+	unsigned long sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+
+	return snprintf(buf, len, "%s n=%lu avg=%lu p50=%lu p90=%lu p99=%lu max=%lu\n",
+	                name, n, n ? sum / n : 0,
+	                hist_percentile(h, 50), hist_percentile(h, 90),
+	                hist_percentile(h, 99),
+	                atomic_load_explicit(&h->max, memory_order_relaxed));
+}
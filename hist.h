@@ -0,0 +1,37 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/*
+ * Log2 histogram: bucket b counts values in [2^(b-1), 2^b), bucket 0 counts
+ * zeroes. hist_add() is a handful of relaxed atomic operations and meant to
+ * be called from a single writer; any thread may read.
+ */
+#define HIST_BUCKETS 32
+
+struct hist {
+	atomic_ulong count[HIST_BUCKETS];
+	atomic_ulong sum;
+	atomic_ulong max;
+};
+
+static inline void hist_add(struct hist *h, unsigned long v)
+{
+	int b = v ? 64 - __builtin_clzl(v) : 0;
+
+	if (b >= HIST_BUCKETS)
+		b = HIST_BUCKETS - 1;
+
+	atomic_fetch_add_explicit(&h->count[b], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->sum, v, memory_order_relaxed);
+	if (v > atomic_load_explicit(&h->max, memory_order_relaxed))
+		atomic_store_explicit(&h->max, v, memory_order_relaxed);
+}
+
+unsigned long hist_count(struct hist *h);
+unsigned long hist_percentile(struct hist *h, int pct);
+int hist_format(struct hist *h, const char *name, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,454 @@
+/*
+ * Control-plane load generator: fires a weighted mix of commands at smd at
+ * a fixed rate, spread over many sockets, and reports round-trip times,
+ * losses and how the daemon's queues grow.
+ *
+ * Every command goes out as a batched datagram of one record, so its seq
+ * identifies the reply. A command unanswered after the timeout is lost.
+ * A separate socket polls STATS every interval for the pending event and
+ * queued track counts, to see throughput against queue size.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+
+#include "hist.h"
+#include "proto.h"
+
+#define MAX_SOCKETS 1024
+#define MAX_MIX     16
+#define MAX_URIS    64
+#define WINDOW      (1 << 20)     /* commands tracked in flight */
+#define BURST       1000          /* most sent per loop when behind */
+#define STATS_SEQ   0x80000000u   /* seq bit marking the STATS poll */
+
+struct command {
+  const char *name;
+  int type;
+  int uri;          /* takes a link as payload */
+};
+
+static const struct command commands[] = {
+  { "queue",   QUEUE,   1 },
+  { "list",    PUSH,    1 },
+  { "next",    NEXT,    0 },
+  { "clear",   CLEAR,   0 },
+  { "status",  STATUS,  0 },
+  { "stats",   STATS,   0 },
+  { "shuffle", SHUFFLE, 0 },
+  { "tracks",  QLIST,   0 },
+  { NULL,      0,       0 }
+};
+
+struct mix {
+  const struct command *cmd;
+  int weight;
+  unsigned long sent, ok, failed, full, lost;
+  struct hist rtt;
+};
+
+struct request {
+  int64_t sent;
+  int mix;
+  int live;
+};
+
+struct interval {
+  unsigned long sent, answered, lost;
+  struct hist rtt;
+};
+
+static struct mix mix[MAX_MIX];
+static int nmix, total_weight;
+static char *uris[MAX_URIS];
+static int nuris;
+
+static struct request window[WINDOW];
+static uint32_t next_seq, oldest;
+static struct interval cur;
+static struct hist rtt_all;
+static int64_t timeout_us = 1000000;
+
+static int stats_fd = -1;
+static long events = -1, tracks = -1;
+
+static unsigned char buf[PROTO_MAX];
+
+static int64_t now_us()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift, so a seed replays the same command sequence */
+static uint64_t rng = 88172645463325252ULL;
+
+static uint32_t random32()
+{
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng >> 32;
+}
+
+static int connect_server(const char *path)
+{
+  struct sockaddr_in addr;
+  struct sockaddr_un un;
+  int fd;
+
+  if (path) {
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strncpy(un.sun_path, path, sizeof(un.sun_path) - 1);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *) &un, sizeof(un)) < 0) {
+      perror(path);
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(1025);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+    if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+      perror("connect");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (fd < 0) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+
+  return fd;
+}
+
+/*
+ * "queue:40,status:50,next:10"
+ */
+static int parse_mix(char *arg)
+{
+  char *item, *save, *colon;
+  int i;
+
+  for (item = strtok_r(arg, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+    if (nmix == MAX_MIX)
+      return -1;
+
+    colon = strchr(item, ':');
+    if (colon)
+      *colon++ = '\0';
+
+    for (i = 0; commands[i].name && strcmp(commands[i].name, item); ++i)
+      ;
+    if (!commands[i].name) {
+      fprintf(stderr, "Unknown command: %s\n", item);
+      return -1;
+    }
+
+    mix[nmix].cmd = &commands[i];
+    mix[nmix].weight = colon ? atoi(colon) : 1;
+    if (mix[nmix].weight <= 0)
+      return -1;
+    total_weight += mix[nmix++].weight;
+  }
+
+  return nmix ? 0 : -1;
+}
+
+static int pick()
+{
+  int r = random32() % total_weight, i;
+
+  for (i = 0; r >= mix[i].weight; ++i)
+    r -= mix[i].weight;
+  return i;
+}
+
+static int send_record(int fd, uint32_t seq, int type, const char *payload)
+{
+  int len = payload ? strlen(payload) : 0;
+
+  buf[0] = PROTO_MAGIC;
+  buf[1] = PROTO_VERSION;
+  proto_put16(buf + 2, 1);
+  proto_put32(buf + PROTO_HEADER, seq);
+  buf[PROTO_HEADER + 4] = type;
+  proto_put16(buf + PROTO_HEADER + 5, len);
+  memcpy(buf + PROTO_HEADER + PROTO_RECORD, payload, len);
+
+  return send(fd, buf, PROTO_HEADER + PROTO_RECORD + len, 0);
+}
+
+static void send_one(int fd)
+{
+  static unsigned uri;
+  struct request *r;
+  int m = pick();
+
+  /* The slot's previous command, if still unanswered, is given up on */
+  r = &window[next_seq % WINDOW];
+  if (r->live) {
+    ++mix[r->mix].lost;
+    ++cur.lost;
+  }
+
+  r->sent = now_us();
+  r->mix = m;
+  r->live = 1;
+
+  if (send_record(fd, next_seq, mix[m].cmd->type,
+                  mix[m].cmd->uri ? uris[uri++ % nuris] : NULL) < 0) {
+    /* A full socket buffer is loss as well */
+    r->live = 0;
+    ++mix[m].lost;
+    ++cur.lost;
+  }
+
+  ++next_seq;
+  ++mix[m].sent;
+  ++cur.sent;
+}
+
+/*
+ * Count everything older than the timeout as lost.
+ */
+static void expire(int64_t now)
+{
+  struct request *r;
+
+  while (oldest != next_seq) {
+    r = &window[oldest % WINDOW];
+    if (r->live) {
+      if (now - r->sent < timeout_us)
+        break;
+      r->live = 0;
+      ++mix[r->mix].lost;
+      ++cur.lost;
+    }
+    ++oldest;
+  }
+}
+
+static void parse_stats(const char *text, int len)
+{
+  char copy[PROTO_MAX + 1];
+  const char *p;
+
+  memcpy(copy, text, len);
+  copy[len] = '\0';
+
+  if ((p = strstr(copy, "events=")))
+    events = atol(p + 7);
+  if ((p = strstr(copy, "tracks=")))
+    tracks = atol(p + 7);
+}
+
+static void handle_reply(int fd)
+{
+  unsigned char *p, *end;
+  struct request *r;
+  uint32_t seq;
+  int64_t now;
+  int l, n, len;
+  unsigned long rtt;
+
+  while ((l = recv(fd, buf, sizeof(buf), 0)) > 0) {
+    if (l < PROTO_HEADER || buf[0] != PROTO_MAGIC)
+      continue;
+
+    now = now_us();
+    n = proto_get16(buf + 2);
+    p = buf + PROTO_HEADER;
+    end = buf + l;
+
+    while (n-- > 0 && end - p >= PROTO_RECORD) {
+      seq = proto_get32(p);
+      len = proto_get16(p + 5);
+      if (len > end - p - PROTO_RECORD)
+        break;
+
+      if (seq & STATS_SEQ) {
+        parse_stats((char *) p + PROTO_RECORD, len);
+      } else {
+        r = &window[seq % WINDOW];
+        if (r->live && seq - oldest < next_seq - oldest) {
+          r->live = 0;
+          rtt = now - r->sent;
+          hist_add(&mix[r->mix].rtt, rtt);
+          hist_add(&rtt_all, rtt);
+          hist_add(&cur.rtt, rtt);
+          ++cur.answered;
+
+          if (p[4] == PROTO_OK)
+            ++mix[r->mix].ok;
+          else if (p[4] == PROTO_FULL)
+            ++mix[r->mix].full;
+          else
+            ++mix[r->mix].failed;
+        }
+      }
+
+      p += PROTO_RECORD + len;
+    }
+  }
+}
+
+static void report_interval(double t, double secs)
+{
+  printf("t=%.1f sent=%lu answered=%lu lost=%lu rate=%.0f/s p50=%lu p99=%lu max=%lu events=%ld tracks=%ld\n",
+         t, cur.sent, cur.answered, cur.lost, cur.answered / secs,
+         hist_percentile(&cur.rtt, 50), hist_percentile(&cur.rtt, 99),
+         atomic_load(&cur.rtt.max), events, tracks);
+  fflush(stdout);
+  memset(&cur, 0, sizeof(cur));
+}
+
+static void report()
+{
+  char line[256];
+  unsigned long sent = 0, lost = 0;
+  int i;
+
+  printf("\n%-8s %9s %9s %9s %9s %9s\n", "command", "sent", "ok", "failed", "full", "lost");
+  for (i = 0; i < nmix; ++i) {
+    printf("%-8s %9lu %9lu %9lu %9lu %9lu\n", mix[i].cmd->name, mix[i].sent,
+           mix[i].ok, mix[i].failed, mix[i].full, mix[i].lost);
+    sent += mix[i].sent;
+    lost += mix[i].lost;
+  }
+
+  printf("\nrtt_us\n");
+  for (i = 0; i < nmix; ++i) {
+    hist_format(&mix[i].rtt, mix[i].cmd->name, line, sizeof(line));
+    printf("%s", line);
+  }
+  hist_format(&rtt_all, "all", line, sizeof(line));
+  printf("%s", line);
+
+  printf("\nloss=%.3f%% events=%ld tracks=%ld\n",
+         sent ? 100.0 * lost / sent : 0.0, events, tracks);
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+          "usage: %s [-S socket] [-n sockets] [-r rate] [-d seconds] [-i seconds]\n"
+          "          [-m mix] [-u uri[,uri...]] [-t timeout ms] [-s seed]\n"
+          "\n"
+          "  -m  weighted commands, e.g. queue:40,list:10,next:5,clear:1,status:44;\n"
+          "      any of queue list next clear status stats shuffle tracks\n"
+          "  -u  links queued round robin (spotify:track:mock1)\n",
+          prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+  struct epoll_event ev, events_out[64];
+  const char *path = NULL;
+  char default_mix[] = "queue:40,list:10,next:5,clear:1,status:44";
+  char *mix_arg = default_mix, *uri_arg = "spotify:track:mock1", *save;
+  double rate = 1000, duration = 10, interval = 1, t;
+  int nsockets = 16, fds[MAX_SOCKETS];
+  int64_t start, now, last, end;
+  unsigned long due;
+  uint32_t stats_seq = STATS_SEQ;
+  int opt, epfd, i, n, s = 0;
+
+  while ((opt = getopt(argc, argv, "S:n:r:d:i:m:u:t:s:")) != -1) {
+    switch (opt) {
+    case 'S': path = optarg; break;
+    case 'n': nsockets = atoi(optarg); break;
+    case 'r': rate = atof(optarg); break;
+    case 'd': duration = atof(optarg); break;
+    case 'i': interval = atof(optarg); break;
+    case 'm': mix_arg = optarg; break;
+    case 'u': uri_arg = optarg; break;
+    case 't': timeout_us = atol(optarg) * 1000; break;
+    case 's': rng = strtoull(optarg, NULL, 0) | 1; break;
+    default: usage(argv[0]);
+    }
+  }
+
+  if (nsockets < 1 || nsockets > MAX_SOCKETS || rate <= 0 || interval <= 0 ||
+      parse_mix(mix_arg) < 0)
+    usage(argv[0]);
+
+  for (uri_arg = strtok_r(uri_arg, ",", &save); uri_arg && nuris < MAX_URIS;
+       uri_arg = strtok_r(NULL, ",", &save))
+    uris[nuris++] = uri_arg;
+  if (!nuris)
+    usage(argv[0]);
+
+  epfd = epoll_create1(0);
+  for (i = 0; i <= nsockets; ++i) {
+    ev.events = EPOLLIN;
+    ev.data.fd = connect_server(path);
+    if (i < nsockets)
+      fds[i] = ev.data.fd;
+    else
+      stats_fd = ev.data.fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+  }
+
+  start = last = now_us();
+  end = start + (int64_t) (duration * 1e6);
+  send_record(stats_fd, stats_seq++, STATS, NULL);
+
+  for (;;) {
+    now = now_us();
+    if (now >= end + timeout_us || (now >= end && oldest == next_seq))
+      break;
+
+    if (now < end) {
+      due = (now - start) * rate / 1e6;
+      for (n = 0; next_seq < due && n < BURST; ++n)
+        send_one(fds[s++ % nsockets]);
+    }
+
+    n = epoll_wait(epfd, events_out, 64, 1);
+    for (i = 0; i < n; ++i)
+      handle_reply(events_out[i].data.fd);
+
+    now = now_us();
+    expire(now);
+
+    if (now - last >= interval * 1e6) {
+      t = (now - start) / 1e6;
+      report_interval(t, (now - last) / 1e6);
+      last = now;
+      send_record(stats_fd, stats_seq++, STATS, NULL);
+    }
+  }
+
+  /* Everything still unanswered is lost by now */
+  expire(INT64_MAX);
+  if (cur.sent || cur.answered)
+    report_interval((now - start) / 1e6, (now - last) / 1e6);
+
+  /* Where the queues ended up */
+  events = tracks = -1;
+  send_record(stats_fd, stats_seq, STATS, NULL);
+  while (tracks < 0 && epoll_wait(epfd, events_out, 64, 1000) > 0)
+    handle_reply(stats_fd);
+
+  report();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,311 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include "log.h"
+
+#define LOG_RINGS   16          /* threads that can log at once */
+#define LOG_SLOTS   128         /* messages per ring */
+#define LOG_LINE    240         /* longer messages are cut */
+#define LOG_FLUSH_MS 100
+#define LOG_ROTATE  (4 << 20)   /* bytes before the file is rotated */
+#define LOG_KEEP    3           /* rotated files kept: path.1 .. path.3 */
+#define LOG_BATCH   (64 << 10)
+
+struct log_entry {
+  uint64_t ns;
+  int level;
+  int len;
+  char text[LOG_LINE];
+};
+
+/*
+ * One ring per producer thread: head is written only by the owner, tail
+ * only by the flush thread.
+ */
+struct log_ring {
+  _Alignas(64) atomic_size_t head;
+  _Alignas(64) atomic_size_t tail;
+  _Alignas(64) atomic_int owned;
+  atomic_ulong dropped;
+  struct log_entry slots[LOG_SLOTS];
+};
+
+int log_level = LOG_INFO;
+
+static struct log_ring rings[LOG_RINGS];
+static atomic_ulong orphans;   /* dropped for want of a ring */
+static __thread struct log_ring *ring;
+static pthread_key_t ring_key;
+
+static atomic_int running;
+static pthread_t thread;
+static int wake_fd = -1;
+static int fd = -1;
+static char *path;
+static size_t size;
+
+static const char levels[] = "EWID";
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void wake()
+{
+  uint64_t one = 1;
+
+  if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("log: eventfd");
+}
+
+static void ring_release(void *r)
+{
+  atomic_store_explicit(&((struct log_ring *) r)->owned, 0, memory_order_release);
+}
+
+static struct log_ring *ring_claim()
+{
+  int i, free;
+
+  for (i = 0; i < LOG_RINGS; ++i) {
+    free = 0;
+    if (atomic_compare_exchange_strong(&rings[i].owned, &free, 1)) {
+      ring = &rings[i];
+      pthread_setspecific(ring_key, ring);
+      return ring;
+    }
+  }
+
+  return NULL;
+}
+
+void log_msg(int level, const char *fmt, ...)
+{
+  struct log_entry *e;
+  size_t h, t;
+  va_list ap;
+  int len;
+
+  if (level > log_level)
+    return;
+
+  if (!atomic_load_explicit(&running, memory_order_acquire)) {
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    if (!*fmt || fmt[strlen(fmt) - 1] != '\n')
+      fputc('\n', stderr);
+    return;
+  }
+
+  if (!ring && !ring_claim()) {
+    atomic_fetch_add_explicit(&orphans, 1, memory_order_relaxed);
+    return;
+  }
+
+  h = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  t = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (h - t == LOG_SLOTS) {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  e = &ring->slots[h % LOG_SLOTS];
+  e->ns = now_ns();
+  e->level = level;
+
+  va_start(ap, fmt);
+  len = vsnprintf(e->text, LOG_LINE, fmt, ap);
+  va_end(ap);
+
+  if (len < 0)
+    len = 0;
+  if (len >= LOG_LINE)
+    len = LOG_LINE - 1;
+  while (len && e->text[len - 1] == '\n')
+    --len;
+  e->len = len;
+
+  atomic_store_explicit(&ring->head, h + 1, memory_order_release);
+
+  /* Errors and nearly full rings don't wait for the next flush */
+  if (level == LOG_ERROR || h + 1 - t > LOG_SLOTS * 3 / 4)
+    wake();
+}
+
+static void rotate()
+{
+  char from[4096], to[4096];
+  int i;
+
+  close(fd);
+
+  for (i = LOG_KEEP - 1; i > 0; --i) {
+    snprintf(from, sizeof(from), "%s.%d", path, i);
+    snprintf(to, sizeof(to), "%s.%d", path, i + 1);
+    rename(from, to);
+  }
+  snprintf(to, sizeof(to), "%s.1", path);
+  rename(path, to);
+
+  fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  size = 0;
+}
+
+static int format_entry(char *buf, size_t len, const struct log_entry *e)
+{
+  time_t secs = e->ns / 1000000000ULL;
+  struct tm tm;
+
+  localtime_r(&secs, &tm);
+  return snprintf(buf, len, "%02d:%02d:%02d.%03d %c %.*s\n",
+                  tm.tm_hour, tm.tm_min, tm.tm_sec,
+                  (int) (e->ns / 1000000 % 1000), levels[e->level], e->len, e->text);
+}
+
+static void write_out(const char *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len && fd >= 0) {
+    n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    buf += n;
+    len -= n;
+    size += n;
+  }
+
+  if (size > LOG_ROTATE)
+    rotate();
+}
+
+/*
+ * Move everything queued to the file, oldest first across all rings.
+ */
+static void drain()
+{
+  static char batch[LOG_BATCH];
+  struct log_entry *e, *oldest;
+  struct log_ring *from;
+  unsigned long dropped;
+  size_t o = 0, t;
+  int i;
+
+  for (;;) {
+    oldest = NULL;
+    from = NULL;
+
+    for (i = 0; i < LOG_RINGS; ++i) {
+      t = atomic_load_explicit(&rings[i].tail, memory_order_relaxed);
+      if (atomic_load_explicit(&rings[i].head, memory_order_acquire) == t)
+        continue;
+
+      e = &rings[i].slots[t % LOG_SLOTS];
+      if (!oldest || e->ns < oldest->ns) {
+        oldest = e;
+        from = &rings[i];
+      }
+    }
+
+    if (!oldest)
+      break;
+
+    if (o + LOG_LINE + 32 > sizeof(batch)) {
+      write_out(batch, o);
+      o = 0;
+    }
+    o += format_entry(batch + o, sizeof(batch) - o, oldest);
+
+    atomic_fetch_add_explicit(&from->tail, 1, memory_order_release);
+  }
+
+  dropped = atomic_exchange(&orphans, 0);
+  for (i = 0; i < LOG_RINGS; ++i)
+    dropped += atomic_exchange(&rings[i].dropped, 0);
+  if (dropped)
+    o += snprintf(batch + o, sizeof(batch) - o, "log: %lu messages dropped\n", dropped);
+
+  if (o)
+    write_out(batch, o);
+}
+
+static void *log_main(void *data)
+{
+  struct pollfd pfd = { wake_fd, POLLIN, 0 };
+  uint64_t count;
+
+  while (atomic_load(&running)) {
+    if (poll(&pfd, 1, LOG_FLUSH_MS) > 0)
+      while (read(wake_fd, &count, sizeof(count)) > 0)
+        ;
+    drain();
+  }
+
+  drain();
+  return NULL;
+}
+
+int log_start(const char *p, int level)
+{
+  struct stat st;
+
+  log_level = level;
+
+  path = strdup(p);
+  fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+  size = fstat(fd, &st) == 0 ? st.st_size : 0;
+
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_fd < 0 || pthread_key_create(&ring_key, ring_release) != 0) {
+    perror("log");
+    return -1;
+  }
+
+  atomic_store(&running, 1);
+  if (pthread_create(&thread, NULL, log_main, NULL) != 0) {
+    atomic_store(&running, 0);
+    perror("log");
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Flush whatever is queued and fall back to stderr.
+ */
+void log_stop()
+{
+  if (!atomic_exchange(&running, 0))
+    return;
+
+  wake();
+  pthread_join(thread, NULL);
+
+  close(fd);
+  fd = -1;
+}
@@ -0,0 +1,27 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+/*
+ * Leveled logger. log_msg() formats straight into a lock-free ring owned by
+ * the calling thread and never blocks; a background thread merges the
+ * rings in time order and writes them out in batches, rotating the file
+ * once it grows past a limit. When a ring is full the message is dropped
+ * and counted. Before log_start() messages go to stderr.
+ */
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+
+extern int log_level;
+
+int  log_start(const char *path, int level);
+void log_stop();
+void log_msg(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define log_error(...) log_msg(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...)  log_msg(LOG_WARN, __VA_ARGS__)
+#define log_info(...)  log_msg(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) do { if (log_level >= LOG_DEBUG) log_msg(LOG_DEBUG, __VA_ARGS__); } while (0)
+
+#endif
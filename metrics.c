@@ -0,0 +1,359 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "audio.h"
+#include "log.h"
+#include "metrics.h"
+
+/* Scrapers served at once, and how long one may take to send its request */
+#define METRICS_CONNS   4
+#define METRICS_TIMEOUT 5
+
+#define REQUEST_MAX     2048
+#define PAGE_MAX        8192
+
+struct http {
+  int fd;
+  time_t since;
+  char in[REQUEST_MAX];
+  size_t in_len;
+  char *out;
+  size_t out_len, out_off;
+};
+
+/* Indexed by proto.h command type; anything else counts as "unknown" */
+static const char *commands[] = {
+  "quit", "queue", "push", "next", "clear", "status", "stats", "remove",
+  "move", "shuffle", "qlist", "insert", "subscribe", "trace"
+};
+#define COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+static const char *states[] = {
+  "logged_out", "logged_in", "disconnected", "undefined", "offline"
+};
+#define STATES (sizeof(states) / sizeof(states[0]))
+
+static atomic_ulong commands_total[COMMANDS + 1];
+static atomic_ulong states_total[STATES + 1];
+static atomic_ulong played_total;
+static atomic_ulong failed_total;
+
+static int epfd;
+static int listen_fd = -1;
+static struct http conns[METRICS_CONNS];
+
+static char page[PAGE_MAX];
+static size_t page_len;
+
+void metrics_command(int cmd)
+{
+  if (cmd < 0 || cmd >= (int) COMMANDS)
+    cmd = COMMANDS;
+  atomic_fetch_add_explicit(&commands_total[cmd], 1, memory_order_relaxed);
+}
+
+void metrics_track_played()
+{
+  atomic_fetch_add_explicit(&played_total, 1, memory_order_relaxed);
+}
+
+void metrics_load_failed()
+{
+  atomic_fetch_add_explicit(&failed_total, 1, memory_order_relaxed);
+}
+
+void metrics_connection(int state)
+{
+  if (state < 0 || state >= (int) STATES)
+    state = STATES;
+  atomic_fetch_add_explicit(&states_total[state], 1, memory_order_relaxed);
+}
+
+static void put(const char *fmt, ...)
+{
+  va_list ap;
+  int l;
+
+  va_start(ap, fmt);
+  l = vsnprintf(page + page_len, sizeof(page) - page_len, fmt, ap);
+  va_end(ap);
+
+  if (l > 0)
+    page_len += (size_t) l < sizeof(page) - page_len ? (size_t) l : sizeof(page) - page_len - 1;
+}
+
+static void metric(const char *name, const char *type, const char *help)
+{
+  put("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static unsigned long load(atomic_ulong *v)
+{
+  return atomic_load_explicit(v, memory_order_relaxed);
+}
+
+static void render()
+{
+  struct audio_stats st;
+  unsigned long events, tracks;
+  size_t i;
+
+  page_len = 0;
+  audio_get_stats(&st);
+  metrics_queues(&events, &tracks);
+
+  metric("smd_commands_total", "counter", "Control commands received, by type.");
+  for (i = 0; i < COMMANDS; ++i)
+    put("smd_commands_total{type=\"%s\"} %lu\n", commands[i], load(&commands_total[i]));
+  put("smd_commands_total{type=\"unknown\"} %lu\n", load(&commands_total[COMMANDS]));
+
+  metric("smd_event_queue_depth", "gauge", "Commands waiting for their links to load.");
+  put("smd_event_queue_depth %lu\n", events);
+
+  metric("smd_queue_length", "gauge", "Tracks in the play queue.");
+  put("smd_queue_length %lu\n", tracks);
+
+  metric("smd_tracks_played_total", "counter", "Tracks started.");
+  put("smd_tracks_played_total %lu\n", load(&played_total));
+
+  metric("smd_track_load_failures_total", "counter", "Tracks the player failed to load.");
+  put("smd_track_load_failures_total %lu\n", load(&failed_total));
+
+  metric("smd_connection_state_changes_total", "counter",
+         "Connection state updates from libspotify, by new state.");
+  for (i = 0; i < STATES; ++i)
+    put("smd_connection_state_changes_total{state=\"%s\"} %lu\n", states[i], load(&states_total[i]));
+  put("smd_connection_state_changes_total{state=\"unknown\"} %lu\n", load(&states_total[STATES]));
+
+  metric("smd_audio_frames_delivered_total", "counter",
+         "Frames accepted from libspotify, at the source rate.");
+  put("smd_audio_frames_delivered_total %lu\n", st.delivered);
+
+  metric("smd_audio_frames_written_total", "counter", "Frames written to the output.");
+  put("smd_audio_frames_written_total %lu\n", st.frames);
+
+  metric("smd_audio_buffer_ms", "gauge", "Audio waiting in the buffer.");
+  put("smd_audio_buffer_ms %d\n", st.buffered_ms);
+
+  metric("smd_audio_buffer_target_ms", "gauge", "Buffer level audio is accepted up to.");
+  put("smd_audio_buffer_target_ms %d\n", st.buffer_ms);
+
+  metric("smd_audio_xruns_total", "counter", "Output underruns.");
+  put("smd_audio_xruns_total %lu\n", st.xruns);
+}
+
+static int watch(int fd, unsigned int events, int op)
+{
+  struct epoll_event ev;
+
+  ev.events = events;
+  ev.data.fd = fd;
+  return epoll_ctl(epfd, op, fd, &ev);
+}
+
+static void http_close(struct http *h)
+{
+  epoll_ctl(epfd, EPOLL_CTL_DEL, h->fd, NULL);
+  close(h->fd);
+  free(h->out);
+  memset(h, 0, sizeof(*h));
+  h->fd = -1;
+}
+
+static void http_flush(struct http *h)
+{
+  ssize_t l;
+
+  while (h->out_off < h->out_len) {
+    l = send(h->fd, h->out + h->out_off, h->out_len - h->out_off, MSG_NOSIGNAL);
+    if (l < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        watch(h->fd, EPOLLOUT, EPOLL_CTL_MOD);
+        return;
+      }
+      break;
+    }
+    h->out_off += l;
+  }
+
+  http_close(h);
+}
+
+static void http_respond(struct http *h, const char *status, const char *body, size_t len)
+{
+  int l;
+
+  h->out = malloc(256 + len);
+  if (!h->out) {
+    http_close(h);
+    return;
+  }
+
+  l = snprintf(h->out, 256, "HTTP/1.1 %s\r\n"
+               "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+               "Content-Length: %zu\r\n"
+               "Connection: close\r\n\r\n", status, len);
+  memcpy(h->out + l, body, len);
+  h->out_len = l + len;
+
+  http_flush(h);
+}
+
+/*
+ * Answer once the request head is in; its body, if any, is ignored.
+ */
+static void http_read(struct http *h)
+{
+  char *path, *end;
+  ssize_t l;
+
+  l = recv(h->fd, h->in + h->in_len, sizeof(h->in) - 1 - h->in_len, 0);
+  if (l == 0 || (l < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+    http_close(h);
+    return;
+  }
+  if (l < 0)
+    return;
+
+  h->in_len += l;
+  h->in[h->in_len] = '\0';
+
+  if (!strstr(h->in, "\r\n\r\n") && !strstr(h->in, "\n\n")) {
+    if (h->in_len == sizeof(h->in) - 1)
+      http_respond(h, "431 Request Header Fields Too Large", "", 0);
+    return;
+  }
+
+  watch(h->fd, 0, EPOLL_CTL_MOD);
+
+  if (strncmp(h->in, "GET ", 4) != 0) {
+    http_respond(h, "405 Method Not Allowed", "", 0);
+    return;
+  }
+
+  path = h->in + 4;
+  end = path + strcspn(path, " ?\r\n");
+  if (end - path != 8 || memcmp(path, "/metrics", 8) != 0) {
+    http_respond(h, "404 Not Found", "not found\n", 10);
+    return;
+  }
+
+  render();
+  http_respond(h, "200 OK", page, page_len);
+}
+
+/*
+ * Take a new scraper, making room by dropping any that have been sitting
+ * on a slot for too long.
+ */
+static void http_accept()
+{
+  struct http *h = NULL;
+  time_t now = time(NULL);
+  int fd, i;
+
+  fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  for (i = 0; i < METRICS_CONNS; ++i) {
+    if (conns[i].fd >= 0 && now - conns[i].since >= METRICS_TIMEOUT)
+      http_close(&conns[i]);
+    if (conns[i].fd < 0 && !h)
+      h = &conns[i];
+  }
+
+  if (!h) {
+    close(fd);
+    return;
+  }
+
+  h->fd = fd;
+  h->since = now;
+  watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+}
+
+int metrics_start(int fd, int port)
+{
+  struct sockaddr_in addr;
+  int i, one = 1;
+
+  epfd = fd;
+  for (i = 0; i < METRICS_CONNS; ++i)
+    conns[i].fd = -1;
+
+  if (!port)
+    return 0;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) {
+    log_error("metrics: socket: %s", strerror(errno));
+    return -1;
+  }
+
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, 8) < 0) {
+    log_error("metrics: Unable to listen on port %d: %s", port, strerror(errno));
+    close(listen_fd);
+    listen_fd = -1;
+    return -1;
+  }
+
+  watch(listen_fd, EPOLLIN, EPOLL_CTL_ADD);
+  log_info("Metrics on http://127.0.0.1:%d/metrics", port);
+  return 0;
+}
+
+void metrics_stop()
+{
+  int i;
+
+  for (i = 0; i < METRICS_CONNS; ++i)
+    if (conns[i].fd >= 0)
+      http_close(&conns[i]);
+
+  if (listen_fd >= 0)
+    close(listen_fd);
+  listen_fd = -1;
+}
+
+int metrics_handle(int fd, unsigned int events)
+{
+  int i;
+
+  if (fd < 0)
+    return -1;
+
+  if (fd == listen_fd) {
+    http_accept();
+    return 0;
+  }
+
+  for (i = 0; i < METRICS_CONNS; ++i) {
+    if (conns[i].fd != fd)
+      continue;
+    if (conns[i].out)
+      http_flush(&conns[i]);
+    else
+      http_read(&conns[i]);
+    return 0;
+  }
+
+  return -1;
+}
@@ -0,0 +1,29 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+/*
+ * Prometheus metrics, served in the text exposition format to GET /metrics
+ * on 127.0.0.1:port. The listener and its connections run in the main
+ * loop. Counters are relaxed atomic adds that any thread may make; the
+ * audio figures are read from audio_get_stats() at scrape time, so the
+ * audio thread itself never touches this module.
+ */
+#define METRICS_PORT 9105
+
+/* Listen and register with epfd; metrics are simply off if this fails */
+int  metrics_start(int epfd, int port);
+void metrics_stop();
+
+/* Handle epoll events for fd; returns -1 if fd isn't ours */
+int  metrics_handle(int fd, unsigned int events);
+
+/* cmd is a proto.h command type, state an sp_connectionstate */
+void metrics_command(int cmd);
+void metrics_track_played();
+void metrics_load_failed();
+void metrics_connection(int state);
+
+/* Implemented by the daemon: gauges it owns, read at scrape time */
+void metrics_queues(unsigned long *events, unsigned long *tracks);
+
+#endif
@@ -0,0 +1,3 @@
+/* The mock session doesn't check the application key */
+const uint8_t g_appkey[] = { 0 };
+const size_t g_appkey_size = sizeof(g_appkey);
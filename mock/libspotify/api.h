@@ -0,0 +1,208 @@
+/*
+ * The part of the libspotify 12 API that smd uses, implemented by
+ * mock/spotify.c. Types and values match the real header so smd.c builds
+ * unchanged against either.
+ */
+#ifndef PUBLIC_API_H
+#define PUBLIC_API_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPOTIFY_API_VERSION 12
+
+typedef unsigned char bool;
+typedef unsigned char byte;
+
+typedef struct sp_session sp_session;
+typedef struct sp_track sp_track;
+typedef struct sp_album sp_album;
+typedef struct sp_artist sp_artist;
+typedef struct sp_albumbrowse sp_albumbrowse;
+typedef struct sp_artistbrowse sp_artistbrowse;
+typedef struct sp_link sp_link;
+typedef struct sp_playlist sp_playlist;
+typedef struct sp_playlistcontainer sp_playlistcontainer;
+
+typedef enum sp_error {
+  SP_ERROR_OK                        = 0,
+  SP_ERROR_BAD_API_VERSION           = 1,
+  SP_ERROR_API_INITIALIZATION_FAILED = 2,
+  SP_ERROR_TRACK_NOT_PLAYABLE        = 3,
+  SP_ERROR_BAD_APPLICATION_KEY       = 5,
+  SP_ERROR_BAD_USERNAME_OR_PASSWORD  = 6,
+  SP_ERROR_USER_BANNED               = 7,
+  SP_ERROR_UNABLE_TO_CONTACT_SERVER  = 8,
+  SP_ERROR_CLIENT_TOO_OLD            = 9,
+  SP_ERROR_OTHER_PERMANENT           = 10,
+  SP_ERROR_BAD_USER_AGENT            = 11,
+  SP_ERROR_MISSING_CALLBACK          = 12,
+  SP_ERROR_INVALID_INDATA            = 13,
+  SP_ERROR_INDEX_OUT_OF_RANGE        = 14,
+  SP_ERROR_USER_NEEDS_PREMIUM        = 15,
+  SP_ERROR_OTHER_TRANSIENT           = 16,
+  SP_ERROR_IS_LOADING                = 17,
+} sp_error;
+
+typedef enum sp_linktype {
+  SP_LINKTYPE_INVALID  = 0,
+  SP_LINKTYPE_TRACK    = 1,
+  SP_LINKTYPE_ALBUM    = 2,
+  SP_LINKTYPE_ARTIST   = 3,
+  SP_LINKTYPE_SEARCH   = 4,
+  SP_LINKTYPE_PLAYLIST = 5,
+} sp_linktype;
+
+typedef enum sp_connectionstate {
+  SP_CONNECTION_STATE_LOGGED_OUT   = 0,
+  SP_CONNECTION_STATE_LOGGED_IN    = 1,
+  SP_CONNECTION_STATE_DISCONNECTED = 2,
+  SP_CONNECTION_STATE_UNDEFINED    = 3,
+  SP_CONNECTION_STATE_OFFLINE      = 4,
+} sp_connectionstate;
+
+typedef enum sp_artistbrowse_type {
+  SP_ARTISTBROWSE_FULL      = 0,
+  SP_ARTISTBROWSE_NO_TRACKS = 1,
+  SP_ARTISTBROWSE_NO_ALBUMS = 2,
+} sp_artistbrowse_type;
+
+typedef enum sp_sampletype {
+  SP_SAMPLETYPE_INT16_NATIVE_ENDIAN = 0,
+} sp_sampletype;
+
+typedef struct sp_audioformat {
+  sp_sampletype sample_type;
+  int sample_rate;
+  int channels;
+} sp_audioformat;
+
+typedef struct sp_audio_buffer_stats {
+  int samples;
+  int stutter;
+} sp_audio_buffer_stats;
+
+typedef struct sp_session_callbacks {
+  void (*logged_in)(sp_session *session, sp_error error);
+  void (*logged_out)(sp_session *session);
+  void (*metadata_updated)(sp_session *session);
+  void (*connection_error)(sp_session *session, sp_error error);
+  void (*message_to_user)(sp_session *session, const char *message);
+  void (*notify_main_thread)(sp_session *session);
+  int  (*music_delivery)(sp_session *session, const sp_audioformat *format, const void *frames, int num_frames);
+  void (*play_token_lost)(sp_session *session);
+  void (*log_message)(sp_session *session, const char *data);
+  void (*end_of_track)(sp_session *session);
+  void (*streaming_error)(sp_session *session, sp_error error);
+  void (*userinfo_updated)(sp_session *session);
+  void (*start_playback)(sp_session *session);
+  void (*stop_playback)(sp_session *session);
+  void (*get_audio_buffer_stats)(sp_session *session, sp_audio_buffer_stats *stats);
+  void (*offline_status_updated)(sp_session *session);
+  void (*offline_error)(sp_session *session, sp_error error);
+  void (*credentials_blob_updated)(sp_session *session, const char *blob);
+  void (*connectionstate_updated)(sp_session *session);
+  void (*scrobble_error)(sp_session *session, sp_error error);
+  void (*private_session_mode_changed)(sp_session *session, bool is_private);
+} sp_session_callbacks;
+
+typedef struct sp_session_config {
+  int api_version;
+  const char *cache_location;
+  const char *settings_location;
+  const void *application_key;
+  size_t application_key_size;
+  const char *user_agent;
+  const sp_session_callbacks *callbacks;
+  void *userdata;
+  bool compress_playlists;
+  bool dont_save_metadata_for_playlists;
+  bool initially_unload_playlists;
+  const char *device_id;
+  const char *proxy;
+  const char *proxy_username;
+  const char *proxy_password;
+  const char *ca_certs_filename;
+  const char *tracefile;
+} sp_session_config;
+
+typedef struct sp_playlist_callbacks {
+  void (*tracks_added)(sp_playlist *pl, sp_track *const *tracks, int num_tracks, int position, void *userdata);
+  void (*tracks_removed)(sp_playlist *pl, const int *tracks, int num_tracks, void *userdata);
+  void (*tracks_moved)(sp_playlist *pl, const int *tracks, int num_tracks, int new_position, void *userdata);
+  void (*playlist_renamed)(sp_playlist *pl, void *userdata);
+  void (*playlist_state_changed)(sp_playlist *pl, void *userdata);
+  void (*playlist_update_in_progress)(sp_playlist *pl, bool done, void *userdata);
+  void (*playlist_metadata_updated)(sp_playlist *pl, void *userdata);
+} sp_playlist_callbacks;
+
+typedef struct sp_playlistcontainer_callbacks {
+  void (*playlist_added)(sp_playlistcontainer *pc, sp_playlist *playlist, int position, void *userdata);
+  void (*playlist_removed)(sp_playlistcontainer *pc, sp_playlist *playlist, int position, void *userdata);
+  void (*playlist_moved)(sp_playlistcontainer *pc, sp_playlist *playlist, int position, int new_position, void *userdata);
+  void (*container_loaded)(sp_playlistcontainer *pc, void *userdata);
+} sp_playlistcontainer_callbacks;
+
+typedef void albumbrowse_complete_cb(sp_albumbrowse *result, void *userdata);
+typedef void artistbrowse_complete_cb(sp_artistbrowse *result, void *userdata);
+
+const char *sp_error_message(sp_error error);
+
+sp_error sp_session_create(const sp_session_config *config, sp_session **sess);
+sp_error sp_session_release(sp_session *sess);
+sp_error sp_session_login(sp_session *session, const char *username, const char *password, bool remember_me, const char *blob);
+sp_error sp_session_logout(sp_session *session);
+sp_connectionstate sp_session_connectionstate(sp_session *session);
+sp_error sp_session_process_events(sp_session *session, int *next_timeout);
+sp_error sp_session_player_load(sp_session *session, sp_track *track);
+sp_error sp_session_player_play(sp_session *session, bool play);
+sp_error sp_session_player_unload(sp_session *session);
+sp_error sp_session_player_prefetch(sp_session *session, sp_track *track);
+sp_playlistcontainer *sp_session_playlistcontainer(sp_session *session);
+
+sp_link *sp_link_create_from_string(const char *link);
+sp_linktype sp_link_type(sp_link *link);
+sp_track *sp_link_as_track(sp_link *link);
+sp_album *sp_link_as_album(sp_link *link);
+sp_artist *sp_link_as_artist(sp_link *link);
+sp_error sp_link_release(sp_link *link);
+
+bool sp_track_is_loaded(sp_track *track);
+sp_error sp_track_error(sp_track *track);
+int sp_track_num_artists(sp_track *track);
+sp_artist *sp_track_artist(sp_track *track, int index);
+const char *sp_track_name(sp_track *track);
+int sp_track_duration(sp_track *track);
+sp_error sp_track_add_ref(sp_track *track);
+sp_error sp_track_release(sp_track *track);
+
+const char *sp_artist_name(sp_artist *artist);
+
+sp_albumbrowse *sp_albumbrowse_create(sp_session *session, sp_album *album, albumbrowse_complete_cb *callback, void *userdata);
+bool sp_albumbrowse_is_loaded(sp_albumbrowse *alb);
+sp_error sp_albumbrowse_error(sp_albumbrowse *alb);
+int sp_albumbrowse_num_tracks(sp_albumbrowse *alb);
+sp_track *sp_albumbrowse_track(sp_albumbrowse *alb, int index);
+sp_error sp_albumbrowse_release(sp_albumbrowse *alb);
+
+sp_artistbrowse *sp_artistbrowse_create(sp_session *session, sp_artist *artist, sp_artistbrowse_type type, artistbrowse_complete_cb *callback, void *userdata);
+bool sp_artistbrowse_is_loaded(sp_artistbrowse *arb);
+sp_error sp_artistbrowse_error(sp_artistbrowse *arb);
+int sp_artistbrowse_num_tophit_tracks(sp_artistbrowse *arb);
+sp_track *sp_artistbrowse_tophit_track(sp_artistbrowse *arb, int index);
+sp_error sp_artistbrowse_release(sp_artistbrowse *arb);
+
+sp_playlist *sp_playlist_create(sp_session *session, sp_link *link);
+bool sp_playlist_is_loaded(sp_playlist *playlist);
+sp_error sp_playlist_add_callbacks(sp_playlist *playlist, sp_playlist_callbacks *callbacks, void *userdata);
+sp_error sp_playlist_remove_callbacks(sp_playlist *playlist, sp_playlist_callbacks *callbacks, void *userdata);
+int sp_playlist_num_tracks(sp_playlist *playlist);
+sp_track *sp_playlist_track(sp_playlist *playlist, int index);
+const char *sp_playlist_name(sp_playlist *playlist);
+sp_error sp_playlist_release(sp_playlist *playlist);
+
+sp_error sp_playlistcontainer_add_callbacks(sp_playlistcontainer *pc, sp_playlistcontainer_callbacks *callbacks, void *userdata);
+int sp_playlistcontainer_num_playlists(sp_playlistcontainer *pc);
+bool sp_playlistcontainer_is_loaded(sp_playlistcontainer *pc);
+
+#endif
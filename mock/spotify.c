@@ -0,0 +1,1020 @@
+/*
+ * Stand-in for libspotify, for running smd without a network or an
+ * account (make smd-mock).
+ *
+ * Tracks, playlists, albums and artists come from a fixture file, named by
+ * SMD_MOCK (mock/fixture by default). Loads complete after a fixed delay
+ * from sp_session_process_events, like metadata arriving from the
+ * network. A player thread delivers a synthetic tone through
+ * music_delivery, at a configurable pace and chunk size, and calls
+ * end_of_track when a track's duration has been delivered.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libspotify/api.h>
+
+#define FIXTURE   "mock/fixture"
+#define BUCKETS   (1 << 16)
+#define RETRY_MS  10    /* wait before offering audio the sink refused */
+#define TONE_HZ   440
+
+/* Anything a link can point at */
+struct entry {
+  sp_linktype type;
+  char *uri;
+  char *name;
+  sp_track **tracks;
+  int num_tracks;
+  struct entry *next;
+};
+
+struct sp_artist {
+  struct entry e;
+};
+
+struct sp_album {
+  struct entry e;
+};
+
+struct sp_track {
+  struct entry e;
+  sp_artist *artist;
+  int duration;
+  int missing;        /* not in the fixture, fails once loaded */
+  int unplayable;
+  int loaded;
+  int requested;
+};
+
+struct sp_link {
+  sp_linktype type;
+  struct entry *e;
+};
+
+struct sp_playlist {
+  struct entry *e;
+  int loaded;
+  sp_playlist_callbacks *callbacks[4];
+  void *userdata[4];
+};
+
+struct sp_albumbrowse {
+  sp_album *album;
+  int loaded;
+  albumbrowse_complete_cb *callback;
+  void *userdata;
+};
+
+struct sp_artistbrowse {
+  sp_artist *artist;
+  int loaded;
+  artistbrowse_complete_cb *callback;
+  void *userdata;
+};
+
+struct sp_playlistcontainer {
+  int num_playlists;
+};
+
+struct sp_session {
+  sp_session_callbacks callbacks;
+  void *userdata;
+  sp_connectionstate state;
+};
+
+#define PENDING_LOGIN        0
+#define PENDING_TRACK        1
+#define PENDING_PLAYLIST     2
+#define PENDING_ALBUMBROWSE  3
+#define PENDING_ARTISTBROWSE 4
+
+/* Loads that complete once their time comes */
+struct pending {
+  int64_t at;
+  int kind;
+  void *obj;
+  struct pending *next;
+};
+
+/* Settings, from the fixture */
+static int    rate      = 44100;
+static int    channels  = 2;
+static int    chunk     = 2048;   /* frames per music_delivery */
+static double speed     = 0;      /* multiple of real time, 0 = as accepted */
+static int    load_ms   = 20;
+static int    login_ms  = 50;
+
+static struct entry *entries[BUCKETS];
+static struct pending *pending;
+static struct pending *due;       /* being completed right now */
+static struct sp_session the_session;
+static struct sp_playlistcontainer container;
+
+static int16_t *tone;             /* one second, loops seamlessly */
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  sp_track *track;
+  int playing;
+  long pos;
+  unsigned gen;
+} player = {
+  .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static int64_t now_ms()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *xcalloc(size_t n, size_t size)
+{
+  void *p = calloc(n, size);
+
+  if (!p)
+    abort();
+  return p;
+}
+
+/*
+ * =============================================================================
+ * Fixture
+ * =============================================================================
+ */
+
+static unsigned hash(const char *s)
+{
+  unsigned h = 2166136261u;
+
+  while (*s)
+    h = (h ^ (unsigned char) *s++) * 16777619u;
+  return h % BUCKETS;
+}
+
+static struct entry *lookup(const char *uri)
+{
+  struct entry *e;
+
+  for (e = entries[hash(uri)]; e; e = e->next)
+    if (!strcmp(e->uri, uri))
+      return e;
+  return NULL;
+}
+
+static void add_entry(struct entry *e, sp_linktype type, const char *uri, const char *name)
+{
+  unsigned h = hash(uri);
+
+  e->type = type;
+  e->uri = strdup(uri);
+  e->name = strdup(name);
+  e->next = entries[h];
+  entries[h] = e;
+}
+
+static sp_linktype link_type(const char *uri)
+{
+  if (!strncmp(uri, "spotify:track:", 14))
+    return SP_LINKTYPE_TRACK;
+  if (!strncmp(uri, "spotify:album:", 14))
+    return SP_LINKTYPE_ALBUM;
+  if (!strncmp(uri, "spotify:artist:", 15))
+    return SP_LINKTYPE_ARTIST;
+  if (!strncmp(uri, "spotify:search:", 15))
+    return SP_LINKTYPE_SEARCH;
+  if (!strncmp(uri, "spotify:", 8) && strstr(uri, ":playlist:"))
+    return SP_LINKTYPE_PLAYLIST;
+  return SP_LINKTYPE_INVALID;
+}
+
+static sp_track *add_track(const char *uri, const char *name, const char *artist, int duration)
+{
+  sp_track *t = xcalloc(1, sizeof(*t));
+
+  add_entry(&t->e, SP_LINKTYPE_TRACK, uri, name);
+  t->artist = xcalloc(1, sizeof(*t->artist));
+  t->artist->e.type = SP_LINKTYPE_ARTIST;
+  t->artist->e.name = strdup(artist);
+  t->duration = duration;
+  return t;
+}
+
+/*
+ * Tracks not in the fixture load like any other, then report an error.
+ */
+static sp_track *find_track(const char *uri)
+{
+  struct entry *e = lookup(uri);
+  sp_track *t;
+
+  if (e)
+    return e->type == SP_LINKTYPE_TRACK ? (sp_track *) e : NULL;
+
+  t = add_track(uri, uri, "", 0);
+  t->missing = 1;
+  return t;
+}
+
+static void add_tracks(struct entry *e, char *list)
+{
+  char *uri, *save;
+  sp_track *t;
+
+  for (uri = strtok_r(list, " ", &save); uri; uri = strtok_r(NULL, " ", &save)) {
+    if (!(t = find_track(uri)))
+      continue;
+    e->tracks = realloc(e->tracks, (e->num_tracks + 1) * sizeof(*e->tracks));
+    if (!e->tracks)
+      abort();
+    e->tracks[e->num_tracks++] = t;
+  }
+}
+
+/*
+ * A playlist of n generated tracks, spotify:track:<id>-1 and up, where id
+ * is the last part of the playlist URI.
+ */
+static void generate(struct entry *e, int n, int duration)
+{
+  const char *id = strrchr(e->uri, ':') + 1;
+  char uri[256], name[64];
+  int i;
+
+  e->tracks = xcalloc(n, sizeof(*e->tracks));
+  for (i = 0; i < n; ++i) {
+    snprintf(uri, sizeof(uri), "spotify:track:%s-%d", id, i + 1);
+    snprintf(name, sizeof(name), "%s %d", e->name, i + 1);
+    e->tracks[i] = add_track(uri, name, "Generated", duration);
+  }
+  e->num_tracks = n;
+}
+
+static int setting(const char *key, const char *value)
+{
+  if (!strcmp(key, "rate"))
+    rate = atoi(value);
+  else if (!strcmp(key, "channels"))
+    channels = atoi(value);
+  else if (!strcmp(key, "chunk"))
+    chunk = atoi(value);
+  else if (!strcmp(key, "speed"))
+    speed = atof(value);
+  else if (!strcmp(key, "load_ms"))
+    load_ms = atoi(value);
+  else if (!strcmp(key, "login_ms"))
+    login_ms = atoi(value);
+  else
+    return -1;
+  return 0;
+}
+
+/*
+ * One directive per line, fields separated by tabs:
+ *
+ *   <setting>  <value>
+ *   track      <uri>  <name>  <artist>  <duration ms>  [unplayable]
+ *   playlist   <uri>  <name>  <track uris, space separated>
+ *   album      <uri>  <name>  <track uris>
+ *   artist     <uri>  <name>  <top hit track uris>
+ *   generate   <playlist uri>  <name>  <count>  <duration ms>
+ *
+ * Tracks must be listed before anything that refers to them, others are
+ * taken to be missing.
+ */
+static int load_fixture(const char *path)
+{
+  char line[65536], *f[6], *save;
+  struct entry *e;
+  int n, no = 0;
+  FILE *fp;
+
+  fp = fopen(path, "r");
+  if (!fp) {
+    perror(path);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fp)) {
+    ++no;
+    line[strcspn(line, "\r\n")] = '\0';
+    if (!*line || *line == '#')
+      continue;
+
+    memset(f, 0, sizeof(f));
+    f[0] = strtok_r(line, "\t", &save);
+    for (n = 1; n < 6 && (f[n] = strtok_r(NULL, "\t", &save)); ++n)
+      ;
+
+    if (!strcmp(f[0], "track") && n >= 5) {
+      add_track(f[1], f[2], f[3], atoi(f[4]))->unplayable =
+        f[5] && !strcmp(f[5], "unplayable");
+    } else if (!strcmp(f[0], "playlist") && n >= 3) {
+      e = xcalloc(1, sizeof(*e));
+      add_entry(e, SP_LINKTYPE_PLAYLIST, f[1], f[2]);
+      if (f[3])
+        add_tracks(e, f[3]);
+      ++container.num_playlists;
+    } else if (!strcmp(f[0], "album") && n >= 3) {
+      e = xcalloc(1, sizeof(struct sp_album));
+      add_entry(e, SP_LINKTYPE_ALBUM, f[1], f[2]);
+      if (f[3])
+        add_tracks(e, f[3]);
+    } else if (!strcmp(f[0], "artist") && n >= 3) {
+      e = xcalloc(1, sizeof(struct sp_artist));
+      add_entry(e, SP_LINKTYPE_ARTIST, f[1], f[2]);
+      if (f[3])
+        add_tracks(e, f[3]);
+    } else if (!strcmp(f[0], "generate") && n >= 5) {
+      e = xcalloc(1, sizeof(*e));
+      add_entry(e, SP_LINKTYPE_PLAYLIST, f[1], f[2]);
+      generate(e, atoi(f[3]), atoi(f[4]));
+      ++container.num_playlists;
+    } else if (n < 2 || setting(f[0], f[1]) < 0) {
+      fprintf(stderr, "%s:%d: bad directive: %s\n", path, no, f[0]);
+      fclose(fp);
+      return -1;
+    }
+  }
+
+  fclose(fp);
+
+  if (rate <= 0 || channels <= 0 || chunk <= 0 || speed < 0) {
+    fprintf(stderr, "%s: bad audio settings\n", path);
+    return -1;
+  }
+  if (chunk > rate)
+    chunk = rate;
+
+  return 0;
+}
+
+/*
+ * =============================================================================
+ * Loading
+ * =============================================================================
+ */
+
+static void notify()
+{
+  if (the_session.callbacks.notify_main_thread)
+    the_session.callbacks.notify_main_thread(&the_session);
+}
+
+static void schedule(int kind, void *obj, int delay)
+{
+  struct pending *p = xcalloc(1, sizeof(*p));
+
+  p->at = now_ms() + delay;
+  p->kind = kind;
+  p->obj = obj;
+  p->next = pending;
+  pending = p;
+
+  /* Have the main loop ask for the new timeout */
+  notify();
+}
+
+static void unlink_obj(struct pending **pp, void *obj)
+{
+  struct pending *p;
+
+  while ((p = *pp)) {
+    if (p->obj == obj) {
+      *pp = p->next;
+      free(p);
+    } else {
+      pp = &p->next;
+    }
+  }
+}
+
+static void unschedule(void *obj)
+{
+  unlink_obj(&pending, obj);
+  unlink_obj(&due, obj);
+}
+
+static void request_track(sp_track *t)
+{
+  if (t->requested)
+    return;
+
+  t->requested = 1;
+  if (load_ms)
+    schedule(PENDING_TRACK, t, load_ms);
+  else
+    t->loaded = 1;
+}
+
+static void load_tracks(struct entry *e)
+{
+  int i;
+
+  if (!e)
+    return;
+
+  for (i = 0; i < e->num_tracks; ++i) {
+    e->tracks[i]->requested = 1;
+    e->tracks[i]->loaded = 1;
+  }
+}
+
+static void login_done()
+{
+  the_session.state = SP_CONNECTION_STATE_LOGGED_IN;
+
+  if (the_session.callbacks.logged_in)
+    the_session.callbacks.logged_in(&the_session, SP_ERROR_OK);
+  if (the_session.callbacks.connectionstate_updated)
+    the_session.callbacks.connectionstate_updated(&the_session);
+}
+
+static void playlist_loaded(sp_playlist *pl)
+{
+  sp_playlist_callbacks *callbacks[4];
+  void *userdata[4];
+  int i;
+
+  pl->loaded = 1;
+  load_tracks(pl->e);
+
+  /* A callback may remove itself */
+  memcpy(callbacks, pl->callbacks, sizeof(callbacks));
+  memcpy(userdata, pl->userdata, sizeof(userdata));
+  for (i = 0; i < 4; ++i)
+    if (callbacks[i] && callbacks[i]->playlist_state_changed)
+      callbacks[i]->playlist_state_changed(pl, userdata[i]);
+}
+
+static void albumbrowse_loaded(sp_albumbrowse *b)
+{
+  b->loaded = 1;
+  load_tracks(b->album ? &b->album->e : NULL);
+  if (b->callback)
+    b->callback(b, b->userdata);
+}
+
+static void artistbrowse_loaded(sp_artistbrowse *b)
+{
+  b->loaded = 1;
+  load_tracks(b->artist ? &b->artist->e : NULL);
+  if (b->callback)
+    b->callback(b, b->userdata);
+}
+
+/*
+ * =============================================================================
+ * Player
+ * =============================================================================
+ */
+
+static void make_tone()
+{
+  int i, c;
+  int16_t s;
+
+  tone = xcalloc((size_t) rate * channels, sizeof(*tone));
+  for (i = 0; i < rate; ++i) {
+    s = (int16_t) (8192 * sin(2 * M_PI * TONE_HZ * i / rate));
+    for (c = 0; c < channels; ++c)
+      tone[i * channels + c] = s;
+  }
+}
+
+static void deadline(struct timespec *ts, int64_t ns)
+{
+  clock_gettime(CLOCK_MONOTONIC, ts);
+  ns += ts->tv_nsec;
+  ts->tv_sec += ns / 1000000000;
+  ts->tv_nsec = ns % 1000000000;
+}
+
+/*
+ * Deliver the loaded track in chunks for as long as it is playing. Audio
+ * the sink refuses is offered again RETRY_MS later, as libspotify does.
+ */
+static void *player_main(void *data)
+{
+  sp_audioformat format = { SP_SAMPLETYPE_INT16_NATIVE_ENDIAN, rate, channels };
+  struct timespec ts;
+  int64_t due = 0, now;
+  long total, offset;
+  unsigned gen;
+  int n, got;
+
+  pthread_mutex_lock(&player.lock);
+  for (;;) {
+    if (!player.track || !player.playing) {
+      pthread_cond_wait(&player.cond, &player.lock);
+      due = 0;
+      continue;
+    }
+
+    total = (long) player.track->duration * rate / 1000;
+    if (player.pos >= total) {
+      player.track = NULL;
+      pthread_mutex_unlock(&player.lock);
+      the_session.callbacks.end_of_track(&the_session);
+      pthread_mutex_lock(&player.lock);
+      continue;
+    }
+
+    offset = player.pos % rate;
+    n = chunk;
+    if (n > total - player.pos)
+      n = total - player.pos;
+    if (n > rate - offset)
+      n = rate - offset;
+    gen = player.gen;
+
+    pthread_mutex_unlock(&player.lock);
+    got = the_session.callbacks.music_delivery(&the_session, &format,
+                                               tone + offset * channels, n);
+    pthread_mutex_lock(&player.lock);
+
+    if (gen != player.gen)
+      continue;
+    if (got > 0)
+      player.pos += got;
+
+    if (got < n) {
+      deadline(&ts, RETRY_MS * 1000000LL);
+      pthread_cond_timedwait(&player.cond, &player.lock, &ts);
+      continue;
+    }
+
+    if (speed > 0) {
+      /* Hold delivery to the configured pace, without catching up bursts */
+      now = now_ms() * 1000000;
+      if (due < now - 1000000000LL)
+        due = now;
+      due += (int64_t) (got * 1e9 / (rate * speed));
+      if (due > now) {
+        deadline(&ts, due - now);
+        pthread_cond_timedwait(&player.cond, &player.lock, &ts);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * =============================================================================
+ * API
+ * =============================================================================
+ */
+
+const char *sp_error_message(sp_error error)
+{
+  switch (error) {
+  case SP_ERROR_OK:                 return "No error";
+  case SP_ERROR_TRACK_NOT_PLAYABLE: return "Track not playable";
+  case SP_ERROR_OTHER_PERMANENT:    return "Unknown link";
+  case SP_ERROR_IS_LOADING:         return "Resource not loaded yet";
+  default:                          return "Mock error";
+  }
+}
+
+sp_error sp_session_create(const sp_session_config *config, sp_session **sess)
+{
+  const char *path = getenv("SMD_MOCK");
+  pthread_condattr_t attr;
+
+  if (config->api_version != SPOTIFY_API_VERSION)
+    return SP_ERROR_BAD_API_VERSION;
+  if (!config->callbacks || !config->callbacks->music_delivery ||
+      !config->callbacks->end_of_track)
+    return SP_ERROR_MISSING_CALLBACK;
+
+  if (load_fixture(path ? path : FIXTURE) < 0)
+    return SP_ERROR_API_INITIALIZATION_FAILED;
+
+  the_session.callbacks = *config->callbacks;
+  the_session.userdata = config->userdata;
+  the_session.state = SP_CONNECTION_STATE_LOGGED_OUT;
+
+  make_tone();
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&player.cond, &attr);
+  if (pthread_create(&player.thread, NULL, player_main, NULL) != 0)
+    return SP_ERROR_API_INITIALIZATION_FAILED;
+  pthread_detach(player.thread);
+
+  *sess = &the_session;
+  return SP_ERROR_OK;
+}
+
+sp_error sp_session_release(sp_session *sess)
+{
+  return SP_ERROR_OK;
+}
+
+sp_error sp_session_login(sp_session *session, const char *username, const char *password, bool remember_me, const char *blob)
+{
+  schedule(PENDING_LOGIN, session, login_ms);
+  return SP_ERROR_OK;
+}
+
+sp_error sp_session_logout(sp_session *session)
+{
+  sp_session_player_unload(session);
+  session->state = SP_CONNECTION_STATE_LOGGED_OUT;
+  return SP_ERROR_OK;
+}
+
+sp_connectionstate sp_session_connectionstate(sp_session *session)
+{
+  return session->state;
+}
+
+/*
+ * Complete everything whose time has come. Track loads are announced
+ * together through metadata_updated, as libspotify does.
+ */
+sp_error sp_session_process_events(sp_session *session, int *next_timeout)
+{
+  struct pending **pp, *p;
+  int64_t now = now_ms(), next = now + 1000;
+  int metadata = 0;
+
+  /* Take out what is due first, callbacks may release or schedule more */
+  for (pp = &pending; (p = *pp); ) {
+    if (p->at <= now) {
+      *pp = p->next;
+      p->next = due;
+      due = p;
+    } else {
+      pp = &p->next;
+    }
+  }
+
+  while ((p = due)) {
+    due = p->next;
+
+    switch (p->kind) {
+    case PENDING_LOGIN:
+      login_done();
+      break;
+    case PENDING_TRACK:
+      ((sp_track *) p->obj)->loaded = 1;
+      metadata = 1;
+      break;
+    case PENDING_PLAYLIST:
+      playlist_loaded(p->obj);
+      break;
+    case PENDING_ALBUMBROWSE:
+      albumbrowse_loaded(p->obj);
+      break;
+    case PENDING_ARTISTBROWSE:
+      artistbrowse_loaded(p->obj);
+      break;
+    }
+    free(p);
+  }
+
+  if (metadata && session->callbacks.metadata_updated)
+    session->callbacks.metadata_updated(session);
+
+  for (p = pending; p; p = p->next)
+    if (p->at < next)
+      next = p->at;
+
+  *next_timeout = next > now ? next - now : 1;
+  return SP_ERROR_OK;
+}
+
+sp_error sp_session_player_load(sp_session *session, sp_track *track)
+{
+  if (!track->loaded)
+    return SP_ERROR_IS_LOADING;
+  if (track->missing || track->unplayable)
+    return SP_ERROR_TRACK_NOT_PLAYABLE;
+
+  pthread_mutex_lock(&player.lock);
+  player.track = track;
+  player.playing = 0;
+  player.pos = 0;
+  ++player.gen;
+  pthread_cond_signal(&player.cond);
+  pthread_mutex_unlock(&player.lock);
+
+  return SP_ERROR_OK;
+}
+
+sp_error sp_session_player_play(sp_session *session, bool play)
+{
+  pthread_mutex_lock(&player.lock);
+  player.playing = play;
+  pthread_cond_signal(&player.cond);
+  pthread_mutex_unlock(&player.lock);
+
+  return SP_ERROR_OK;
+}
+
+sp_error sp_session_player_unload(sp_session *session)
+{
+  pthread_mutex_lock(&player.lock);
+  player.track = NULL;
+  player.playing = 0;
+  ++player.gen;
+  pthread_cond_signal(&player.cond);
+  pthread_mutex_unlock(&player.lock);
+
+  return SP_ERROR_OK;
+}
+
+sp_error sp_session_player_prefetch(sp_session *session, sp_track *track)
+{
+  return track->loaded ? SP_ERROR_OK : SP_ERROR_IS_LOADING;
+}
+
+sp_playlistcontainer *sp_session_playlistcontainer(sp_session *session)
+{
+  return session->state == SP_CONNECTION_STATE_LOGGED_IN ? &container : NULL;
+}
+
+sp_link *sp_link_create_from_string(const char *uri)
+{
+  sp_linktype type = link_type(uri);
+  sp_link *link;
+
+  if (type == SP_LINKTYPE_INVALID)
+    return NULL;
+
+  link = xcalloc(1, sizeof(*link));
+  link->type = type;
+  link->e = type == SP_LINKTYPE_TRACK ? (struct entry *) find_track(uri) : lookup(uri);
+  if (link->e && link->e->type != type)
+    link->e = NULL;
+
+  return link;
+}
+
+sp_linktype sp_link_type(sp_link *link)
+{
+  return link->type;
+}
+
+sp_track *sp_link_as_track(sp_link *link)
+{
+  if (link->type != SP_LINKTYPE_TRACK || !link->e)
+    return NULL;
+
+  request_track((sp_track *) link->e);
+  return (sp_track *) link->e;
+}
+
+sp_album *sp_link_as_album(sp_link *link)
+{
+  return link->type == SP_LINKTYPE_ALBUM ? (sp_album *) link->e : NULL;
+}
+
+sp_artist *sp_link_as_artist(sp_link *link)
+{
+  return link->type == SP_LINKTYPE_ARTIST ? (sp_artist *) link->e : NULL;
+}
+
+sp_error sp_link_release(sp_link *link)
+{
+  free(link);
+  return SP_ERROR_OK;
+}
+
+bool sp_track_is_loaded(sp_track *track)
+{
+  return track->loaded;
+}
+
+sp_error sp_track_error(sp_track *track)
+{
+  if (!track->loaded)
+    return SP_ERROR_IS_LOADING;
+  return track->missing ? SP_ERROR_OTHER_PERMANENT : SP_ERROR_OK;
+}
+
+int sp_track_num_artists(sp_track *track)
+{
+  return track->loaded ? 1 : 0;
+}
+
+sp_artist *sp_track_artist(sp_track *track, int index)
+{
+  return index == 0 ? track->artist : NULL;
+}
+
+const char *sp_track_name(sp_track *track)
+{
+  return track->loaded ? track->e.name : "";
+}
+
+int sp_track_duration(sp_track *track)
+{
+  return track->loaded ? track->duration : 0;
+}
+
+/* Tracks live as long as the fixture */
+sp_error sp_track_add_ref(sp_track *track)
+{
+  return SP_ERROR_OK;
+}
+
+sp_error sp_track_release(sp_track *track)
+{
+  return SP_ERROR_OK;
+}
+
+const char *sp_artist_name(sp_artist *artist)
+{
+  return artist ? artist->e.name : "";
+}
+
+sp_albumbrowse *sp_albumbrowse_create(sp_session *session, sp_album *album, albumbrowse_complete_cb *callback, void *userdata)
+{
+  sp_albumbrowse *b = xcalloc(1, sizeof(*b));
+
+  b->album = album;
+  b->callback = callback;
+  b->userdata = userdata;
+  schedule(PENDING_ALBUMBROWSE, b, load_ms);
+  return b;
+}
+
+bool sp_albumbrowse_is_loaded(sp_albumbrowse *alb)
+{
+  return alb->loaded;
+}
+
+sp_error sp_albumbrowse_error(sp_albumbrowse *alb)
+{
+  if (!alb->loaded)
+    return SP_ERROR_IS_LOADING;
+  return alb->album ? SP_ERROR_OK : SP_ERROR_OTHER_PERMANENT;
+}
+
+int sp_albumbrowse_num_tracks(sp_albumbrowse *alb)
+{
+  return alb->loaded && alb->album ? alb->album->e.num_tracks : 0;
+}
+
+sp_track *sp_albumbrowse_track(sp_albumbrowse *alb, int index)
+{
+  if (index < 0 || index >= sp_albumbrowse_num_tracks(alb))
+    return NULL;
+  return alb->album->e.tracks[index];
+}
+
+sp_error sp_albumbrowse_release(sp_albumbrowse *alb)
+{
+  unschedule(alb);
+  free(alb);
+  return SP_ERROR_OK;
+}
+
+sp_artistbrowse *sp_artistbrowse_create(sp_session *session, sp_artist *artist, sp_artistbrowse_type type, artistbrowse_complete_cb *callback, void *userdata)
+{
+  sp_artistbrowse *b = xcalloc(1, sizeof(*b));
+
+  b->artist = artist;
+  b->callback = callback;
+  b->userdata = userdata;
+  schedule(PENDING_ARTISTBROWSE, b, load_ms);
+  return b;
+}
+
+bool sp_artistbrowse_is_loaded(sp_artistbrowse *arb)
+{
+  return arb->loaded;
+}
+
+sp_error sp_artistbrowse_error(sp_artistbrowse *arb)
+{
+  if (!arb->loaded)
+    return SP_ERROR_IS_LOADING;
+  return arb->artist ? SP_ERROR_OK : SP_ERROR_OTHER_PERMANENT;
+}
+
+int sp_artistbrowse_num_tophit_tracks(sp_artistbrowse *arb)
+{
+  return arb->loaded && arb->artist ? arb->artist->e.num_tracks : 0;
+}
+
+sp_track *sp_artistbrowse_tophit_track(sp_artistbrowse *arb, int index)
+{
+  if (index < 0 || index >= sp_artistbrowse_num_tophit_tracks(arb))
+    return NULL;
+  return arb->artist->e.tracks[index];
+}
+
+sp_error sp_artistbrowse_release(sp_artistbrowse *arb)
+{
+  unschedule(arb);
+  free(arb);
+  return SP_ERROR_OK;
+}
+
+/*
+ * Playlists missing from the fixture never load, like a link to a
+ * playlist that doesn't exist.
+ */
+sp_playlist *sp_playlist_create(sp_session *session, sp_link *link)
+{
+  sp_playlist *pl;
+
+  if (link->type != SP_LINKTYPE_PLAYLIST)
+    return NULL;
+
+  pl = xcalloc(1, sizeof(*pl));
+  pl->e = link->e;
+  if (pl->e)
+    schedule(PENDING_PLAYLIST, pl, load_ms);
+  return pl;
+}
+
+bool sp_playlist_is_loaded(sp_playlist *playlist)
+{
+  return playlist->loaded;
+}
+
+sp_error sp_playlist_add_callbacks(sp_playlist *playlist, sp_playlist_callbacks *callbacks, void *userdata)
+{
+  int i;
+
+  for (i = 0; i < 4; ++i) {
+    if (!playlist->callbacks[i]) {
+      playlist->callbacks[i] = callbacks;
+      playlist->userdata[i] = userdata;
+      return SP_ERROR_OK;
+    }
+  }
+
+  return SP_ERROR_OTHER_TRANSIENT;
+}
+
+sp_error sp_playlist_remove_callbacks(sp_playlist *playlist, sp_playlist_callbacks *callbacks, void *userdata)
+{
+  int i;
+
+  for (i = 0; i < 4; ++i) {
+    if (playlist->callbacks[i] == callbacks && playlist->userdata[i] == userdata) {
+      playlist->callbacks[i] = NULL;
+      playlist->userdata[i] = NULL;
+    }
+  }
+
+  return SP_ERROR_OK;
+}
+
+int sp_playlist_num_tracks(sp_playlist *playlist)
+{
+  return playlist->loaded ? playlist->e->num_tracks : 0;
+}
+
+sp_track *sp_playlist_track(sp_playlist *playlist, int index)
+{
+  if (index < 0 || index >= sp_playlist_num_tracks(playlist))
+    return NULL;
+  return playlist->e->tracks[index];
+}
+
+const char *sp_playlist_name(sp_playlist *playlist)
+{
+  return playlist->loaded ? playlist->e->name : "";
+}
+
+sp_error sp_playlist_release(sp_playlist *playlist)
+{
+  unschedule(playlist);
+  free(playlist);
+  return SP_ERROR_OK;
+}
+
+/* The container is loaded as soon as the session is logged in */
+sp_error sp_playlistcontainer_add_callbacks(sp_playlistcontainer *pc, sp_playlistcontainer_callbacks *callbacks, void *userdata)
+{
+  return SP_ERROR_OK;
+}
+
+int sp_playlistcontainer_num_playlists(sp_playlistcontainer *pc)
+{
+  return pc->num_playlists;
+}
+
+bool sp_playlistcontainer_is_loaded(sp_playlistcontainer *pc)
+{
+  return 1;
+}
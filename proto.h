@@ -0,0 +1,102 @@
+#ifndef _PROTO_H_
+#define _PROTO_H_
+
+#include <stdint.h>
+
+/*
+ * Control protocol, shared by smd and client.
+ *
+ * Legacy datagrams carry one command: type, a 16-bit big-endian payload
+ * length and the payload. Only STATUS, STATS and QLIST are answered, with
+ * type 0.
+ *
+ * Batched datagrams start with PROTO_MAGIC, which no command type uses:
+ *
+ *   magic, version, count (16 bits)
+ *   count times: seq (32 bits), type, length (16 bits), payload
+ *
+ * Every command is answered, in order, with a reply in the same framing
+ * where each record carries the command's seq, a PROTO_* status in place
+ * of the type and the result (if any) as payload. A reply that doesn't fit
+ * one datagram is split over several. All integers are big-endian.
+ *
+ * A connected client may SUBSCRIBE with a payload of "<mask> [<ms>]", an
+ * OR of PROTO_EV_* and the position tick interval (default 1000, raised
+ * to PROTO_TICK_MIN); a mask of 0 unsubscribes, unknown bits are an
+ * error. From then on it is sent event messages:
+ *
+ *   PROTO_EVENT, version, event (one PROTO_EV_*), length (16 bits), text
+ *
+ * Subscribers that fall behind are disconnected.
+ */
+#define QUIT    0
+#define QUEUE   1
+#define PUSH    2
+#define NEXT    3
+#define CLEAR   4
+#define STATUS  5
+#define STATS   6
+#define REMOVE  7
+#define MOVE    8
+#define SHUFFLE 9
+#define QLIST   10
+#define INSERT  11
+#define SUBSCRIBE 12
+#define TRACE   13      /* write the trace ring to smd's -T file */
+
+#define PROTO_MAGIC    0xB5
+#define PROTO_VERSION  1
+#define PROTO_HEADER   4
+#define PROTO_RECORD   7
+#define PROTO_MAX      65507
+#define PROTO_EVENT    0xB6
+
+#define PROTO_OK       0
+#define PROTO_ERROR    1
+#define PROTO_UNKNOWN  2
+#define PROTO_BADVERSION 3
+/*
+ * Over the daemon's memory budget. QUEUE, PUSH, INSERT and NEXT are checked
+ * on arrival, allowing one queue entry per command still resolving; a
+ * playlist, album or artist that turns out not to fit is dropped whole
+ * when it resolves.
+ */
+#define PROTO_FULL     4
+
+/* "<artist> - <title> mm:ss.mmm" or "stopped", as for STATUS */
+#define PROTO_EV_TRACK    1
+/* "<n> tracks" */
+#define PROTO_EV_QUEUE    2
+/* "<buffer ms> ms <xruns> xruns" */
+#define PROTO_EV_BUFFER   4
+/* "<position ms> <duration ms>", while playing */
+#define PROTO_EV_POSITION 8
+#define PROTO_EV_ALL      15
+
+#define PROTO_TICK_MIN    100
+
+static inline void proto_put16(unsigned char *p, unsigned v)
+{
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static inline void proto_put32(unsigned char *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static inline unsigned proto_get16(const unsigned char *p)
+{
+  return p[0] << 8 | p[1];
+}
+
+static inline uint32_t proto_get32(const unsigned char *p)
+{
+  return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+#endif
@@ -0,0 +1,207 @@
+#include <string.h>
+
+#include "resample.h"
+
+#define ONE ((uint64_t) 1 << 32)
+
+/*
+ * Positions are measured in input frames on a virtual stream v where v[0]
+ * is the last frame of the previous call and v[k] = in[k - 1]. An output
+ * frame at position p interpolates between v[p >> 32] and v[(p >> 32) + 1].
+ */
+
+void resampler_init(struct resampler *rs, int out_rate, int out_channels)
+{
+	memset(rs, 0, sizeof(*rs));
+	rs->out_rate = out_rate;
+	rs->out_channels = out_channels;
+}
+
+static void resampler_reset(struct resampler *rs, int in_rate, int in_channels)
+{
+	rs->in_rate = in_rate;
+	rs->in_channels = in_channels;
+	rs->step = ((uint64_t) in_rate << 32) / rs->out_rate;
+	rs->pos = ONE;
+	memset(rs->last, 0, sizeof(rs->last));
+}
+
+/*
+ * Map one frame of ic channels onto oc channels: mono is copied to every
+ * output, anything to mono is averaged, otherwise channels wrap around.
+ */
+static inline void mix_frame(const int32_t *f, int ic, int16_t *out, int oc)
+{
+	int32_t sum;
+	int c;
+
+	if (oc == 1 && ic > 1) {
+		for (sum = 0, c = 0; c < ic; ++c)
+			sum += f[c];
+		out[0] = sum / ic;
+		return;
+	}
+
+	for (c = 0; c < oc; ++c)
+		out[c] = f[c % ic];
+}
+
+/* Same rate, channel count differs */
+static void remix(const int16_t *restrict in, int ic, int16_t *restrict out, int oc, size_t n)
+{
+	int32_t f[RESAMPLE_MAX_CHANNELS];
+	size_t i;
+	int c;
+
+	if (ic == 1 && oc == 2) {
+		for (i = 0; i < n; ++i) {
+			out[2 * i] = in[i];
+			out[2 * i + 1] = in[i];
+		}
+		return;
+	}
+
+	if (ic == 2 && oc == 1) {
+		for (i = 0; i < n; ++i)
+			out[i] = ((int32_t) in[2 * i] + in[2 * i + 1]) >> 1;
+		return;
+	}
+
+	for (i = 0; i < n; ++i) {
+		for (c = 0; c < ic; ++c)
+			f[c] = in[i * ic + c];
+		mix_frame(f, ic, out + i * oc, oc);
+	}
+}
+
+/*
+ * Interpolate m output frames starting at position pos, all of which lie at
+ * or after v[1], so both neighbours come straight from in. Mono and stereo
+ * in and out, the common cases, get loops of their own without the inner
+ * per-channel loop. These don't vectorize: every output frame loads from
+ * an index computed from its position.
+ */
+static void interpolate(const int16_t *restrict in, int ic, int16_t *restrict out,
+                        int oc, uint64_t pos, uint64_t step, size_t m)
+{
+	int32_t f[RESAMPLE_MAX_CHANNELS];
+	size_t j, k;
+	int32_t a, b, x;
+	int c;
+
+	if (ic == 2 && oc == 2) {
+		for (j = 0; j < m; ++j) {
+			uint64_t p = pos + j * step;
+
+			k = (p >> 32) - 1;
+			x = (p >> 17) & 0x7fff;
+			a = in[2 * k];
+			b = in[2 * k + 2];
+			out[2 * j] = a + (((b - a) * x) >> 15);
+			a = in[2 * k + 1];
+			b = in[2 * k + 3];
+			out[2 * j + 1] = a + (((b - a) * x) >> 15);
+		}
+		return;
+	}
+
+	if (ic == 1 && oc == 1) {
+		for (j = 0; j < m; ++j) {
+			uint64_t p = pos + j * step;
+
+			k = (p >> 32) - 1;
+			x = (p >> 17) & 0x7fff;
+			a = in[k];
+			b = in[k + 1];
+			out[j] = a + (((b - a) * x) >> 15);
+		}
+		return;
+	}
+
+	if (ic == oc) {
+		for (j = 0; j < m; ++j) {
+			uint64_t p = pos + j * step;
+
+			k = (p >> 32) - 1;
+			x = (p >> 17) & 0x7fff;
+			for (c = 0; c < ic; ++c) {
+				a = in[k * ic + c];
+				b = in[(k + 1) * ic + c];
+				out[j * oc + c] = a + (((b - a) * x) >> 15);
+			}
+		}
+		return;
+	}
+
+	for (j = 0; j < m; ++j) {
+		uint64_t p = pos + j * step;
+
+		k = (p >> 32) - 1;
+		x = (p >> 17) & 0x7fff;
+		for (c = 0; c < ic; ++c) {
+			a = in[k * ic + c];
+			b = in[(k + 1) * ic + c];
+			f[c] = a + (((b - a) * x) >> 15);
+		}
+		mix_frame(f, ic, out + j * oc, oc);
+	}
+}
+
+/*
+ * Convert up to *n input frames into at most max_out output frames. On
+ * return *n holds the number of input frames consumed; the return value is
+ * the number of output frames produced.
+ */
+size_t resampler_run(struct resampler *rs, int in_rate, int in_channels,
+                     const int16_t *in, size_t *n, int16_t *out, size_t max_out)
+{
+	int32_t f[RESAMPLE_MAX_CHANNELS];
+	uint64_t end;
+	size_t m, j, c;
+	int ic = in_channels;
+	int oc = rs->out_channels;
+	int i;
+
+	if (in_rate == rs->out_rate) {
+		if (*n > max_out)
+			*n = max_out;
+		if (ic == oc)
+			memcpy(out, in, *n * ic * sizeof(int16_t));
+		else
+			remix(in, ic, out, oc, *n);
+		return *n;
+	}
+
+	if (in_rate != rs->in_rate || ic != rs->in_channels)
+		resampler_reset(rs, in_rate, ic);
+
+	/* Every output frame needs its right neighbour, so stop before v[n] */
+	end = (uint64_t) *n << 32;
+	m = rs->pos < end ? (end - rs->pos + rs->step - 1) / rs->step : 0;
+	if (m > max_out)
+		m = max_out;
+
+	/* Frames interpolating against the previous call's last frame */
+	for (j = 0; j < m && rs->pos + j * rs->step < ONE; ++j) {
+		uint64_t p = rs->pos + j * rs->step;
+		int32_t x = (p >> 17) & 0x7fff;
+
+		for (i = 0; i < ic; ++i)
+			f[i] = rs->last[i] + (((in[i] - rs->last[i]) * x) >> 15);
+		mix_frame(f, ic, out + j * oc, oc);
+	}
+
+	interpolate(in, ic, out + j * oc, oc, rs->pos + j * rs->step, rs->step, m - j);
+
+	rs->pos += m * rs->step;
+	c = rs->pos >> 32;
+	if (c > *n)
+		c = *n;
+	if (c > 0)
+		for (i = 0; i < ic; ++i)
+			rs->last[i] = in[(c - 1) * ic + i];
+	rs->pos -= (uint64_t) c << 32;
+
+	*n = c;
+	return m;
+}
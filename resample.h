@@ -0,0 +1,29 @@
+#ifndef _RESAMPLE_H_
+#define _RESAMPLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RESAMPLE_MAX_CHANNELS 8
+
+/*
+ * Linear interpolating sample-rate and channel converter for interleaved
+ * int16 audio. The output format is fixed; the input format may change
+ * between calls, which restarts the interpolation.
+ */
+struct resampler {
+	int in_rate;
+	int in_channels;
+	int out_rate;
+	int out_channels;
+
+	uint64_t step;   /* input frames per output frame, 32.32 fixed point */
+	uint64_t pos;    /* position of the next output frame, see resample.c */
+	int16_t last[RESAMPLE_MAX_CHANNELS];
+};
+
+void   resampler_init(struct resampler *rs, int out_rate, int out_channels);
+size_t resampler_run(struct resampler *rs, int in_rate, int in_channels,
+                     const int16_t *in, size_t *n, int16_t *out, size_t max_out);
+
+#endif
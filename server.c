@@ -0,0 +1,605 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "proto.h"
+#include "server.h"
+#include "trace.h"
+
+/* Connections are looked up by fd, so this bounds the fds served */
+#define CONN_MAX     1024
+
+/* Output queued for a client that isn't reading before it is dropped */
+#define CONN_OUT_MAX (1 << 20)
+
+/* The same for subscribers, checked whenever an event goes out */
+#define SUB_OUT_MAX  (64 << 10)
+
+/* Largest reply to one command: a datagram for UDP, more for connections */
+#define REPLY_UDP    1000
+#define REPLY_CONN   (PROTO_MAX - PROTO_HEADER - PROTO_RECORD)
+
+struct conn {
+  int fd;
+  int stream;
+  int dead;
+
+  /* Stream input: partial frames */
+  unsigned char *in;
+  size_t in_len;
+
+  /* Queued output, every message preceded by its length */
+  unsigned char *out;
+  size_t out_len, out_cap;
+
+  /* Subscription: PROTO_EV_* mask and position tick interval */
+  int events;
+  int interval;
+  int64_t next_tick;
+  struct conn *next_sub;
+};
+
+/* Where a reply goes: a UDP address or a connection */
+struct peer {
+  int fd;
+  struct conn *conn;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+};
+
+static int epfd;
+static int udp_fd = -1, seq_fd = -1, stream_fd = -1;
+static char seq_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+static char stream_path[sizeof(seq_path)];
+
+static struct conn *conns[CONN_MAX];
+static struct conn *subs;
+static int sub_events;
+
+static unsigned char msg_buf[PROTO_MAX + 1];
+static unsigned char reply_buf[PROTO_MAX];
+static char result[REPLY_CONN];
+
+static int watch(int fd, unsigned int events, int op)
+{
+  struct epoll_event ev;
+
+  ev.events = events;
+  ev.data.fd = fd;
+  return epoll_ctl(epfd, op, fd, &ev);
+}
+
+static int listen_unix(int type, const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  unlink(path);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+
+  watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+  return fd;
+}
+
+int server_start(int fd, const char *path)
+{
+  struct sockaddr_in addr;
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(1025);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  epfd = fd;
+
+  udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+  if (udp_fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  if (bind(udp_fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)) < 0) {
+    perror("bind");
+    return -1;
+  }
+  watch(udp_fd, EPOLLIN, EPOLL_CTL_ADD);
+
+  /* The unix sockets are a bonus; UDP alone still works */
+  snprintf(seq_path, sizeof(seq_path), "%s", path);
+  snprintf(stream_path, sizeof(stream_path), "%s.stream", path);
+  seq_fd = listen_unix(SOCK_SEQPACKET, seq_path);
+  stream_fd = listen_unix(SOCK_STREAM, stream_path);
+
+  log_info("Server started");
+  return 0;
+}
+
+static void unsubscribe(struct conn *c)
+{
+  struct conn **sp;
+
+  for (sp = &subs; *sp; sp = &(*sp)->next_sub) {
+    if (*sp == c) {
+      *sp = c->next_sub;
+      break;
+    }
+  }
+
+  c->events = 0;
+  sub_events = 0;
+  for (c = subs; c; c = c->next_sub)
+    sub_events |= c->events;
+}
+
+static void conn_close(struct conn *c)
+{
+  if (c->events)
+    unsubscribe(c);
+
+  epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  conns[c->fd] = NULL;
+
+  free(c->in);
+  free(c->out);
+  free(c);
+}
+
+void server_stop()
+{
+  int fd;
+
+  for (fd = 0; fd < CONN_MAX; ++fd)
+    if (conns[fd])
+      conn_close(conns[fd]);
+
+  if (seq_fd >= 0) {
+    close(seq_fd);
+    unlink(seq_path);
+  }
+  if (stream_fd >= 0) {
+    close(stream_fd);
+    unlink(stream_path);
+  }
+  if (udp_fd >= 0)
+    close(udp_fd);
+}
+
+static void conn_accept(int lfd)
+{
+  struct conn *c;
+  int fd;
+
+  fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  if (fd >= CONN_MAX || !(c = calloc(1, sizeof(*c)))) {
+    close(fd);
+    return;
+  }
+
+  c->fd = fd;
+  c->stream = lfd == stream_fd;
+  if (c->stream && !(c->in = malloc(4 + PROTO_MAX + 1))) {
+    close(fd);
+    free(c);
+    return;
+  }
+
+  conns[fd] = c;
+  watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+}
+
+/*
+ * Write out as much queued output as the socket takes, and ask for
+ * EPOLLOUT while anything is left.
+ */
+static void conn_flush(struct conn *c)
+{
+  size_t o = 0, len;
+  ssize_t n;
+
+  while (o < c->out_len) {
+    if (c->stream) {
+      n = send(c->fd, c->out + o, c->out_len - o, MSG_NOSIGNAL);
+    } else {
+      len = proto_get32(c->out + o);
+      n = send(c->fd, c->out + o + 4, len, MSG_NOSIGNAL);
+      if (n >= 0)
+        n = len + 4;
+    }
+
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        c->dead = 1;
+      break;
+    }
+    o += n;
+  }
+
+  memmove(c->out, c->out + o, c->out_len - o);
+  c->out_len -= o;
+
+  watch(c->fd, c->out_len ? EPOLLIN | EPOLLOUT : EPOLLIN, EPOLL_CTL_MOD);
+}
+
+static int conn_queue(struct conn *c, const unsigned char *buf, size_t len)
+{
+  unsigned char *out;
+  size_t cap;
+
+  if (c->out_len + 4 + len > CONN_OUT_MAX) {
+    log_warn("Dropping client %d: not reading", c->fd);
+    c->dead = 1;
+    return -1;
+  }
+
+  if (c->out_len + 4 + len > c->out_cap) {
+    cap = c->out_cap ? c->out_cap : 4096;
+    while (cap < c->out_len + 4 + len)
+      cap *= 2;
+    out = realloc(c->out, cap);
+    if (!out) {
+      c->dead = 1;
+      return -1;
+    }
+    c->out = out;
+    c->out_cap = cap;
+  }
+
+  proto_put32(c->out + c->out_len, len);
+  memcpy(c->out + c->out_len + 4, buf, len);
+  c->out_len += 4 + len;
+
+  if (c->out_len == 4 + len)
+    conn_flush(c);
+  return 0;
+}
+
+static int peer_send(struct peer *p, const unsigned char *buf, int len)
+{
+  if (p->conn)
+    return conn_queue(p->conn, buf, len);
+
+  return sendto(p->fd, buf, len, 0, (struct sockaddr *) &p->addr, p->addrlen);
+}
+
+static void send_legacy(struct peer *p, char type, char *payload, int len)
+{
+  reply_buf[0] = type;
+  reply_buf[1] = (char) ((len >> 8) & 0xFF);
+  reply_buf[2] = (char) (len & 0xFF);
+
+  if (len)
+    memcpy(reply_buf + 3, payload, len);
+
+  log_debug("Send: %d %.*s", type, len, payload);
+
+  peer_send(p, reply_buf, len + 3);
+}
+
+static void send_batch(struct peer *p, int n, int len)
+{
+  reply_buf[0] = PROTO_MAGIC;
+  reply_buf[1] = PROTO_VERSION;
+  proto_put16(reply_buf + 2, n);
+
+  peer_send(p, reply_buf, len);
+}
+
+/*
+ * SUBSCRIBE is about the connection rather than the player, so it is
+ * handled here. Only connections can subscribe.
+ */
+static int subscribe(struct peer *p, char *payload, int *rlen)
+{
+  struct conn *c = p->conn;
+  int events = 0, interval = 1000;
+
+  *rlen = 0;
+  if (!c || sscanf(payload, "%d %d", &events, &interval) < 1 || interval <= 0 ||
+      events & ~PROTO_EV_ALL)
+    return PROTO_ERROR;
+
+  /* Every tick wakes the main loop, so don't let anyone ask for many */
+  if (interval < PROTO_TICK_MIN)
+    interval = PROTO_TICK_MIN;
+
+  if (c->events)
+    unsubscribe(c);
+
+  c->events = events;
+  c->interval = interval;
+  c->next_tick = 0;
+  if (events) {
+    c->next_sub = subs;
+    subs = c;
+    sub_events |= events;
+  }
+
+  log_info("Client %d subscribed to %#x every %d ms", c->fd, events, interval);
+  return PROTO_OK;
+}
+
+/*
+ * Run one legacy command; msg has room for a terminator after l bytes.
+ */
+static void handle_legacy(struct peer *p, unsigned char *msg, int l, int size)
+{
+  int cmd, len, rlen;
+
+  if (l < 3)
+    return;
+
+  len = proto_get16(msg + 1);
+  if (len + 3 > l || (!p->conn && len >= 1020))
+    return;
+
+  cmd = msg[0];
+  msg[len + 3] = '\0';
+
+  log_debug("Recvd: %d %s", cmd, msg + 3);
+  metrics_command(cmd);
+
+  if (cmd == SUBSCRIBE)
+    subscribe(p, (char *) msg + 3, &rlen);
+  else
+    server_command(cmd, (char *) msg + 3, len, result, size, &rlen);
+  if (rlen)
+    send_legacy(p, 0, result, rlen);
+}
+
+/*
+ * Run every command of a batched message and answer them all, packing as
+ * many results per reply as fit.
+ */
+static void handle_batch(struct peer *p, unsigned char *msg, int l, int size)
+{
+  unsigned char *q = msg + PROTO_HEADER, *end = msg + l;
+  unsigned char save;
+  int count, type, len, rlen, status, n = 0, o = PROTO_HEADER;
+  uint32_t seq;
+
+  if (l < PROTO_HEADER)
+    return;
+
+  if (msg[1] != PROTO_VERSION) {
+    memset(reply_buf + o, 0, PROTO_RECORD);
+    reply_buf[o + 4] = PROTO_BADVERSION;
+    send_batch(p, 1, o + PROTO_RECORD);
+    return;
+  }
+
+  count = proto_get16(msg + 2);
+  log_debug("Recvd: batch of %d", count);
+
+  while (count-- > 0 && end - q >= PROTO_RECORD) {
+    seq = proto_get32(q);
+    type = q[4];
+    len = proto_get16(q + 5);
+    q += PROTO_RECORD;
+    if (len > end - q)
+      break;
+
+    /* msg has room for the terminator after the last payload */
+    save = q[len];
+    q[len] = '\0';
+    metrics_command(type);
+    if (type == SUBSCRIBE)
+      status = subscribe(p, (char *) q, &rlen);
+    else
+      status = server_command(type, (char *) q, len, result, size, &rlen);
+    q[len] = save;
+    q += len;
+
+    if (o + PROTO_RECORD + rlen > PROTO_MAX) {
+      send_batch(p, n, o);
+      n = 0;
+      o = PROTO_HEADER;
+    }
+
+    proto_put32(reply_buf + o, seq);
+    reply_buf[o + 4] = status;
+    proto_put16(reply_buf + o + 5, rlen);
+    memcpy(reply_buf + o + PROTO_RECORD, result, rlen);
+    o += PROTO_RECORD + rlen;
+    ++n;
+  }
+
+  if (n)
+    send_batch(p, n, o);
+}
+
+static void handle_message(struct peer *p, unsigned char *msg, int l)
+{
+  int size = p->conn ? REPLY_CONN : REPLY_UDP;
+  uint64_t start = trace_now();
+  char label[16];
+
+  /* Labelled first, the handlers may write into msg */
+  if (l > 0 && msg[0] == PROTO_MAGIC) {
+    snprintf(label, sizeof(label), "batch %u", l >= PROTO_HEADER ? proto_get16(msg + 2) : 0);
+    handle_batch(p, msg, l, size);
+  } else {
+    snprintf(label, sizeof(label), "cmd %d", l > 0 ? msg[0] : -1);
+    handle_legacy(p, msg, l, size);
+  }
+
+  trace_span(TRACE_RECV, start, trace_now(), 0, label);
+}
+
+static void handle_udp()
+{
+  struct peer p = { .fd = udp_fd };
+  int l;
+
+  p.addrlen = sizeof(p.addr);
+  l = recvfrom(udp_fd, msg_buf, PROTO_MAX, MSG_DONTWAIT, (struct sockaddr *) &p.addr, &p.addrlen);
+  if (l > 0)
+    handle_message(&p, msg_buf, l);
+}
+
+static void handle_conn(struct conn *c)
+{
+  struct peer p = { .fd = c->fd, .conn = c };
+  unsigned char save;
+  size_t o = 0, len;
+  ssize_t l;
+
+  if (!c->stream) {
+    l = recv(c->fd, msg_buf, PROTO_MAX, MSG_DONTWAIT);
+    if (l > 0)
+      handle_message(&p, msg_buf, l);
+    else if (l == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      c->dead = 1;
+    return;
+  }
+
+  l = read(c->fd, c->in + c->in_len, 4 + PROTO_MAX - c->in_len);
+  if (l == 0 || (l < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+    c->dead = 1;
+    return;
+  }
+  if (l < 0)
+    return;
+  c->in_len += l;
+
+  while (!c->dead && c->in_len - o >= 4) {
+    len = proto_get32(c->in + o);
+    if (len > PROTO_MAX) {
+      c->dead = 1;
+      break;
+    }
+    if (c->in_len - o < 4 + len)
+      break;
+
+    /* The terminator borrows the next frame's first byte */
+    save = c->in[o + 4 + len];
+    handle_message(&p, c->in + o + 4, len);
+    c->in[o + 4 + len] = save;
+    o += 4 + len;
+  }
+
+  memmove(c->in, c->in + o, c->in_len - o);
+  c->in_len -= o;
+}
+
+int server_events()
+{
+  return sub_events;
+}
+
+/*
+ * Encode an event once and queue it for every subscriber that wants it;
+ * tick selects only those whose position tick is due at now.
+ */
+static void publish(int event, const char *payload, int len, int tick, int64_t now)
+{
+  struct conn *c, *next;
+  unsigned char msg[5 + 1000];
+
+  if (len > 1000)
+    len = 1000;
+
+  msg[0] = PROTO_EVENT;
+  msg[1] = PROTO_VERSION;
+  msg[2] = event;
+  proto_put16(msg + 3, len);
+  memcpy(msg + 5, payload, len);
+
+  for (c = subs; c; c = next) {
+    next = c->next_sub;
+    if (!(c->events & event))
+      continue;
+
+    if (tick) {
+      if (c->next_tick > now)
+        continue;
+      c->next_tick = now + c->interval;
+    }
+
+    if (c->out_len > SUB_OUT_MAX) {
+      log_warn("Dropping subscriber %d: not reading", c->fd);
+      c->dead = 1;
+    } else {
+      conn_queue(c, msg, 5 + len);
+    }
+
+    if (c->dead)
+      conn_close(c);
+  }
+}
+
+void server_publish(int event, const char *payload, int len)
+{
+  if (sub_events & event)
+    publish(event, payload, len, 0, 0);
+}
+
+int server_tick_due(int64_t now)
+{
+  struct conn *c;
+  int64_t ms = -1;
+
+  for (c = subs; c; c = c->next_sub) {
+    if (!(c->events & PROTO_EV_POSITION))
+      continue;
+    if (c->next_tick <= now)
+      return 0;
+    if (ms < 0 || c->next_tick - now < ms)
+      ms = c->next_tick - now;
+  }
+
+  return ms;
+}
+
+void server_tick(int64_t now, const char *payload, int len)
+{
+  publish(PROTO_EV_POSITION, payload, len, 1, now);
+}
+
+int server_handle(int fd, unsigned int events)
+{
+  struct conn *c;
+
+  if (fd == udp_fd) {
+    handle_udp();
+  } else if (fd == seq_fd || fd == stream_fd) {
+    conn_accept(fd);
+  } else if (fd >= 0 && fd < CONN_MAX && (c = conns[fd])) {
+    if (events & EPOLLOUT)
+      conn_flush(c);
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+      handle_conn(c);
+    if (c->dead)
+      conn_close(c);
+  } else {
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include <stdint.h>
+
+/*
+ * Control server. Commands arrive over UDP on 127.0.0.1:1025, over an
+ * AF_UNIX SOCK_SEQPACKET socket (one message per packet) and over an
+ * AF_UNIX SOCK_STREAM socket at the same path plus ".stream" (every
+ * message preceded by its 32-bit big-endian length). Messages use the
+ * formats in proto.h; unix clients may stay connected for as long as they
+ * like.
+ */
+#define SERVER_PATH "/tmp/smd.sock"
+
+/* Open the sockets and register them with epfd */
+int  server_start(int epfd, const char *path);
+void server_stop();
+
+/* Handle epoll events for fd; returns -1 if fd isn't the server's */
+int  server_handle(int fd, unsigned int events);
+
+/*
+ * Subscriptions. server_events() is the PROTO_EV_* mask anyone listens
+ * to, so callers can skip formatting events nobody wants. Publish from the
+ * main loop only, never from within server_command(), since a subscriber
+ * that has fallen behind is closed on the spot.
+ */
+int  server_events();
+void server_publish(int event, const char *payload, int len);
+
+/* Milliseconds until some subscriber wants a position tick, or -1 */
+int  server_tick_due(int64_t now);
+void server_tick(int64_t now, const char *payload, int len);
+
+/*
+ * Implemented by the daemon: run one command, writing any result (at most
+ * size bytes) to reply and its length to *rlen. Returns a PROTO_* status.
+ */
+int  server_command(int cmd, char *payload, int len, char *reply, int size, int *rlen);
+
+#endif
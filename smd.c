@@ -4,11 +4,17 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
 #include <time.h>
 #include <signal.h>
 #include <time.h>
 #include <poll.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/timerfd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -23,16 +29,40 @@
 #define STATE_READY     3
 
 #include "audio.h"
+#include "log.h"
+#include "metrics.h"
+#include "proto.h"
+#include "server.h"
+#include "status.h"
+#include "trace.h"
+#include "tracklist.h"
 #include "keys.h"
 
-struct track {
-  sp_track *track;
-  struct track *next;
-};
+#define EVENT_NEW     0
+#define EVENT_LOADING 1
+#define EVENT_READY   2
+#define EVENT_FAILED  3
 
 struct event {
   int type;
   char *data;
+  int state;
+  time_t stamp;
+
+  sp_link *link;
+  sp_track *track;
+  sp_playlist *playlist;
+  sp_albumbrowse *albumbrowse;
+  sp_artistbrowse *artistbrowse;
+
+  size_t pos;
+
+  /* Trace id and when it was queued, picked up and settled */
+  uint32_t trace_id;
+  uint64_t queued;
+  uint64_t resolving;
+  uint64_t settled;
+
   struct event *next;
 };
 
@@ -40,33 +70,59 @@ struct event {
 static sp_session     *session;
 static int             state;
 
-static int             qlen;
-static struct track   *track_queue;
+static struct tracklist track_queue;
 static struct event   *event_queue;
+static struct event  **event_tail = &event_queue;
 static sp_track       *current_track;
 static time_t          stamp;
 
+/*
+ * The track being heard. It becomes current_track once the audio thread
+ * has played out everything before track_mark, see audio_mark_track().
+ */
+static sp_track       *playing_track;
+static unsigned int    track_mark;
+static int             track_pending;
+static int             prefetched;
 
-/* Main thread notification structure */
-static int             notify_events;
-static pthread_mutex_t notify_mutex;
-static pthread_cond_t  notify_cond;
+/*
+ * Memory budget (-M): pending events and the track queue may only grow
+ * while they and the audio ring together stay below it.
+ */
+#define MEM_BUDGET_MB 64
 
-/* Server */
-static int             socket_fd;
-static char            socket_buf[1024];
+static size_t          mem_budget = (size_t) MEM_BUDGET_MB << 20;
+static size_t          event_bytes;
+static int             event_count;
+static size_t          audio_bytes;
+
+/* What subscribers haven't been told about yet */
+static int             track_changed;
+static int             queue_changed;
+
+
+/*
+ * Main thread notification: libspotify's threads write notify_fd, and
+ * timer_fd fires when libspotify (or the next prefetch) wants attention.
+ */
+static int             notify_fd;
+static int             timer_fd;
+static atomic_int      track_ended;
 
-FILE *log_fd;
+/* Server */
+static const char     *socket_path = SERVER_PATH;
+static const char     *trace_path = "trace.json";
+static int             metrics_port = METRICS_PORT;
 
-#define QUIT   0
-#define QUEUE  1
-#define PUSH   2
-#define NEXT   3
-#define CLEAR  4
-#define STATUS 5
 
 #define CRED_FILE "tmp/creds"
 
+/* How long before the end of a track the next one is prefetched */
+#define PREFETCH_MS 10000
+
+/* How long a link may take to load before it is dropped */
+#define RESOLVE_TIMEOUT 30
+
 /*
  * =============================================================================
  * API
@@ -74,227 +130,444 @@ FILE *log_fd;
  */
 static int play_track()
 {
+  struct audio_stats st;
+  uint64_t start;
+  uint32_t id;
   sp_error err;
 
   if (current_track) {
+    /* Everything pushed from here on belongs to this track */
+    track_mark = audio_mark_track();
+    id = trace_track_start();
+    start = trace_now();
     err = sp_session_player_load(session, current_track);
+    trace_span(TRACE_PLAYER_LOAD, start, trace_now(), id, sp_track_name(current_track));
     if (err == SP_ERROR_OK) {
-      fprintf(log_fd, "Playing track: %s\n", sp_track_name(current_track));
+      audio_get_stats(&st);
+      log_info("Playing track: %s", sp_track_name(current_track));
+      log_info("Audio: %u writes/s, %u wakeups/s, %lu xruns, %d ms buffer",
+              st.writes_per_sec, st.wakeups_per_sec, st.xruns, st.buffer_ms);
       sp_session_player_play(session, 1);
+      metrics_track_played();
       stamp = time(NULL);
+      prefetched = 0;
+      track_pending = 1;
     } else {
-      fprintf(log_fd, "Failed to load: %s\n", sp_track_name(current_track));
+      log_warn("Failed to load: %s", sp_track_name(current_track));
+      metrics_load_failed();
       current_track = NULL;
       return -1;
     }
   } else {
-    fprintf(log_fd, "No track set\n");
+    log_debug("No track set");
     return -1;
   }
 
   return 0;
 }
 
-void next_track()
+/*
+ * Start the next playable track in the queue. The audio buffer is left
+ * alone, so on a natural end of track the new samples follow directly.
+ */
+static void advance_track()
 {
-  struct track *t;
-
-  sp_session_player_play(session, 0);
-  audio_flush();
-
   do {
-    if (!track_queue) {
-      current_track = NULL;
+    if (current_track)
+      sp_track_release(current_track);
+
+    current_track = tracklist_remove(&track_queue, 0);
+    queue_changed = 1;
+    if (!current_track) {
       stamp = 0;
+      track_mark = audio_mark_track();
+      track_pending = 1;
       return;
     }
+  } while (play_track() == -1);
+}
 
-    t = track_queue;
-    track_queue = t->next;
+void next_track()
+{
+  sp_session_player_play(session, 0);
+  audio_flush();
+  advance_track();
+}
 
-    if (current_track)
-      sp_track_release(current_track);
+/*
+ * Let libspotify start fetching the head of the queue once the current
+ * track is close to its end, so the switch in end_of_track is gapless.
+ */
+static void prefetch_track()
+{
+  sp_track *t;
+
+  if (prefetched || !current_track || !tracklist_len(&track_queue))
+    return;
 
-    current_track = t->track;
-    free(t);
+  if ((time(NULL) - stamp) * 1000 < sp_track_duration(current_track) - PREFETCH_MS)
+    return;
 
-    --qlen;
-  } while (play_track() == -1);
+  t = tracklist_get(&track_queue, 0);
+  if (sp_track_is_loaded(t) && sp_session_player_prefetch(session, t) == SP_ERROR_OK)
+    log_debug("Prefetching track: %s", sp_track_name(t));
+
+  prefetched = 1;
 }
 
-void clear_queue()
+static void release_track(void *track)
 {
-  struct track *t;
+  sp_track_release(track);
+}
 
+void clear_queue()
+{
   sp_session_player_play(session, 0);
-  while (track_queue) {
-    t = track_queue;
-    track_queue = track_queue->next;
+  tracklist_clear(&track_queue, release_track);
+  queue_changed = 1;
+}
 
-    sp_track_release(t->track);
-    free(t);
-  }
+static size_t mem_used()
+{
+  return event_bytes + tracklist_bytes(tracklist_len(&track_queue)) + audio_bytes;
+}
+
+/* Bytes left under the budget */
+static size_t mem_free()
+{
+  size_t used = mem_used();
 
-  qlen = 0;
+  if (!mem_budget)
+    return (size_t) -1;
+  return used < mem_budget ? mem_budget - used : 0;
 }
 
-void push_track(sp_track *track)
+int format_memory(char *buf, int len)
 {
-  struct track *q;
+  int l;
 
-  q = malloc(sizeof(struct track));
-  if (!q)
-    abort();
+  l = snprintf(buf, len, "memory budget=%zu used=%zu events=%d/%zu tracks=%zu/%zu audio=%zu\n",
+               mem_budget, mem_used(), event_count, event_bytes,
+               tracklist_len(&track_queue), tracklist_bytes(tracklist_len(&track_queue)),
+               audio_bytes);
+  return l < len ? l : len - 1;
+}
 
-  sp_track_add_ref(track);
-  q->track = track;
-  q->next = track_queue;
-  track_queue = q;
+void metrics_queues(unsigned long *events, unsigned long *tracks)
+{
+  *events = event_count;
+  *tracks = tracklist_len(&track_queue);
+}
 
-  ++qlen;
+/*
+ * Insert tracks at pos in the queue (clamped, so (size_t) -1 appends) and
+ * start playing if nothing is. Tracks that don't all fit the memory budget
+ * are refused together, so a collection is never queued in part.
+ */
+void insert_tracks(size_t pos, sp_track **tracks, size_t n)
+{
+  size_t i, room = mem_free() / tracklist_bytes(1);
+
+  if (n > room) {
+    log_error("Over memory budget, refusing %zu tracks with room for %zu", n, room);
+    return;
+  }
+  if (n == 0)
+    return;
+
+  if (tracklist_insert_many(&track_queue, pos, (void **) tracks, n) < 0) {
+    log_error("Failed to queue %zu tracks", n);
+    return;
+  }
+
+  for (i = 0; i < n; ++i)
+    sp_track_add_ref(tracks[i]);
+  queue_changed = 1;
+
+  /* A new head of the queue needs prefetching again */
+  if (pos == 0)
+    prefetched = 0;
 
   if (!current_track)
     next_track();
 }
 
+void push_track(sp_track *track)
+{
+  insert_tracks(0, &track, 1);
+}
+
 void queue_track(sp_track *track)
 {
-  struct track *q, *qp;
+  insert_tracks((size_t) -1, &track, 1);
+}
 
-  q = malloc(sizeof(struct track));
-  if (!q)
-    abort();
+/*
+ * =============================================================================
+ * Link resolution
+ * =============================================================================
+ *
+ * Every QUEUE/PUSH/INSERT/NEXT becomes an event that resolves on its own: the link
+ * is created once, then libspotify's callbacks move it from EVENT_LOADING to
+ * EVENT_READY (or EVENT_FAILED).  server_process_events() applies events from
+ * the head of the queue as they settle, so submission order is kept while all
+ * of them load in parallel.
+ */
+static sp_playlist_callbacks event_playlist_callbacks;
+static void event_albumbrowse_complete(sp_albumbrowse *result, void *userdata);
+static void event_artistbrowse_complete(sp_artistbrowse *result, void *userdata);
 
-  sp_track_add_ref(track);
-  q->track = track;
-  q->next = NULL;
+static void event_check(struct event *e)
+{
+  sp_error err;
 
-  ++qlen;
+  if (e->state != EVENT_LOADING)
+    return;
 
-  if (!track_queue) {
-    track_queue = q;
-  } else {
-    qp = track_queue;
-    while (qp->next)
-      qp = qp->next;
-    qp->next = q;
+  if (e->track) {
+    err = sp_track_error(e->track);
+    if (err == SP_ERROR_OK)
+      e->state = EVENT_READY;
+    else if (err != SP_ERROR_IS_LOADING)
+      e->state = EVENT_FAILED;
+  } else if (e->playlist) {
+    if (sp_playlist_is_loaded(e->playlist))
+      e->state = EVENT_READY;
+  } else if (e->albumbrowse) {
+    if (sp_albumbrowse_is_loaded(e->albumbrowse))
+      e->state = sp_albumbrowse_error(e->albumbrowse) == SP_ERROR_OK ?
+        EVENT_READY : EVENT_FAILED;
+  } else if (e->artistbrowse) {
+    if (sp_artistbrowse_is_loaded(e->artistbrowse))
+      e->state = sp_artistbrowse_error(e->artistbrowse) == SP_ERROR_OK ?
+        EVENT_READY : EVENT_FAILED;
   }
 
-  if (!current_track)
-    next_track();
+  if (e->state != EVENT_LOADING)
+    e->settled = trace_now();
 }
 
-void push_playlist(sp_playlist *pl)
+static void event_resolve(struct event *e)
 {
-  int i, n;
-  sp_track *track;
+  e->resolving = e->settled = trace_now();
+  trace_span(TRACE_QUEUED, e->queued, e->resolving, e->trace_id, e->data);
 
-  if (!sp_playlist_is_loaded(pl))
+  e->state = EVENT_FAILED;
+  e->stamp = time(NULL);
+
+  if (e->type == NEXT) {
+    e->state = EVENT_READY;
     return;
+  }
 
-  n = sp_playlist_num_tracks(pl);
-  for (i = 0; i < n; ++i) {
-    track = sp_playlist_track(pl, i);
-    push_track(track);
+  if (!e->data || !(e->link = sp_link_create_from_string(e->data))) {
+    log_warn("Invalid link: %s", e->data ? e->data : "");
+    return;
+  }
+
+  switch (sp_link_type(e->link)) {
+  case SP_LINKTYPE_TRACK:
+    e->track = sp_link_as_track(e->link);
+    if (e->track)
+      sp_track_add_ref(e->track);
+    break;
+  case SP_LINKTYPE_PLAYLIST:
+    e->playlist = sp_playlist_create(session, e->link);
+    if (e->playlist)
+      sp_playlist_add_callbacks(e->playlist, &event_playlist_callbacks, e);
+    break;
+  case SP_LINKTYPE_ALBUM:
+    e->albumbrowse = sp_albumbrowse_create(session, sp_link_as_album(e->link),
+                                           &event_albumbrowse_complete, NULL);
+    break;
+  case SP_LINKTYPE_ARTIST:
+    e->artistbrowse = sp_artistbrowse_create(session, sp_link_as_artist(e->link),
+                                             SP_ARTISTBROWSE_NO_ALBUMS,
+                                             &event_artistbrowse_complete, NULL);
+    break;
+  default:
+    log_warn("Unsupported link: %s", e->data);
+    return;
+  }
+
+  if (e->track || e->playlist || e->albumbrowse || e->artistbrowse) {
+    e->state = EVENT_LOADING;
+    event_check(e);
   }
 }
 
-void queue_playlist(sp_playlist *pl)
+static void event_apply(struct event *e)
 {
+  sp_track **tracks;
+  size_t pos;
   int i, n;
-  sp_track *track;
 
-  if (!sp_playlist_is_loaded(pl))
+  if (e->type == NEXT) {
+    next_track();
     return;
+  }
+
+  if (e->track)
+    n = 1;
+  else if (e->playlist)
+    n = sp_playlist_num_tracks(e->playlist);
+  else if (e->albumbrowse)
+    n = sp_albumbrowse_num_tracks(e->albumbrowse);
+  else
+    n = sp_artistbrowse_num_tophit_tracks(e->artistbrowse);
+
+  if (n <= 0)
+    return;
+
+  tracks = malloc(n * sizeof(*tracks));
+  if (!tracks)
+    abort();
 
-  n = sp_playlist_num_tracks(pl);
   for (i = 0; i < n; ++i) {
-    track = sp_playlist_track(pl, i);
-    queue_track(track);
+    if (e->track)
+      tracks[i] = e->track;
+    else if (e->playlist)
+      tracks[i] = sp_playlist_track(e->playlist, i);
+    else if (e->albumbrowse)
+      tracks[i] = sp_albumbrowse_track(e->albumbrowse, i);
+    else
+      tracks[i] = sp_artistbrowse_tophit_track(e->artistbrowse, i);
   }
+
+  pos = e->type == PUSH ? 0 : e->type == INSERT ? e->pos : (size_t) -1;
+  insert_tracks(pos, tracks, n);
+  free(tracks);
 }
 
-int queue_link(const char *uri)
+static void event_free(struct event *e)
 {
-  sp_link *l;
-  sp_playlist *pl;
-  sp_track *t;
+  if (e->track)
+    sp_track_release(e->track);
+  if (e->playlist) {
+    sp_playlist_remove_callbacks(e->playlist, &event_playlist_callbacks, e);
+    sp_playlist_release(e->playlist);
+  }
+  if (e->albumbrowse)
+    sp_albumbrowse_release(e->albumbrowse);
+  if (e->artistbrowse)
+    sp_artistbrowse_release(e->artistbrowse);
+  if (e->link)
+    sp_link_release(e->link);
+
+  event_bytes -= sizeof(*e) + (e->data ? strlen(e->data) + 1 : 0);
+  --event_count;
+  free(e->data);
+  free(e);
+}
 
-  int r = 0;
+static void event_playlist_state_changed(sp_playlist *pl, void *userdata)
+{
+  event_check(userdata);
+}
 
-  l = sp_link_create_from_string(uri);
-  if (!l)
-    return -1;
+static sp_playlist_callbacks event_playlist_callbacks = {
+  .playlist_state_changed = &event_playlist_state_changed
+};
 
-  switch (sp_link_type(l)) {
-  case SP_LINKTYPE_PLAYLIST:
-    pl = sp_playlist_create(session, l);
-    if (pl && sp_playlist_is_loaded(pl))
-      queue_playlist(pl);
-    else
-      r = -1;
-    break;
-  case SP_LINKTYPE_TRACK:
-    t = sp_link_as_track(l);
-    if (t && sp_track_is_loaded(t))
-      queue_track(t);
-    else
-      r = -1;
-    break;
-  default:
-    break;
-  }
+/*
+ * Browse results are matched by handle rather than through userdata, so a
+ * completion for an event dropped by CLEAR is simply ignored.
+ */
+static void event_albumbrowse_complete(sp_albumbrowse *result, void *userdata)
+{
+  struct event *e;
 
-  sp_link_release(l);
-  return r;
+  for (e = event_queue; e; e = e->next)
+    if (e->albumbrowse == result)
+      event_check(e);
 }
 
-int push_link(const char *uri)
+static void event_artistbrowse_complete(sp_artistbrowse *result, void *userdata)
 {
-  sp_link *l;
-  sp_playlist *pl;
-  sp_track *t;
+  struct event *e;
 
-  int r = 0;
+  for (e = event_queue; e; e = e->next)
+    if (e->artistbrowse == result)
+      event_check(e);
+}
 
-  l = sp_link_create_from_string(uri);
-  if (!l)
-    return -1;
+/*
+ * Track metadata arrives without saying which track it was for; recheck
+ * whatever is still loading.
+ */
+static void metadata_updated(sp_session *session)
+{
+  struct event *e;
 
-  switch (sp_link_type(l)) {
-  case SP_LINKTYPE_PLAYLIST:
-    pl = sp_playlist_create(session, l);
-    if (pl && sp_playlist_is_loaded(pl))
-      push_playlist(pl);
-    else
-      r = -1;
-    break;
-  case SP_LINKTYPE_TRACK:
-    t = sp_link_as_track(l);
-    if (t && sp_track_is_loaded(t))
-      push_track(t);
-    else
-      r = -1;
-    break;
-  default:
-    break;
+  for (e = event_queue; e; e = e->next)
+    event_check(e);
+}
+
+/*
+ * Milliseconds until the oldest loading event times out, or -1.
+ */
+static int events_due()
+{
+  struct event *e;
+  long ms = -1, t;
+
+  for (e = event_queue; e; e = e->next) {
+    if (e->state != EVENT_LOADING)
+      continue;
+    t = (e->stamp + RESOLVE_TIMEOUT - time(NULL)) * 1000;
+    if (t < 0)
+      t = 0;
+    if (ms < 0 || t < ms)
+      ms = t;
   }
 
-  sp_link_release(l);
-  return r;
+  return ms;
 }
 
 int format_current_track(char *buf, int len)
 {
       sp_artist *a;
-      int t;
+      long t;
+
+      t = audio_position_ms();
+      a = sp_track_artist(playing_track, 0);
+      t = snprintf(buf, len, "%s - %s %02ld:%02ld.%03ld",
+                   sp_artist_name(a),
+                   sp_track_name(playing_track),
+                   t / 60000, t / 1000 % 60, t % 1000);
+      return t < len ? t : len - 1;
+}
+
+/*
+ * One queue page: a "<total> tracks" line, then "<pos> <artist> - <title>"
+ * for up to count tracks from offset, as many as fit in len.
+ */
+int format_queue(char *buf, int len, size_t offset, size_t count)
+{
+  sp_track *tracks[64];
+  size_t i, n;
+  int l, r;
+
+  l = snprintf(buf, len, "%zu tracks\n", tracklist_len(&track_queue));
+  while (count > 0 && l < len) {
+    n = tracklist_page(&track_queue, offset, (void **) tracks, count < 64 ? count : 64);
+    if (n == 0)
+      break;
+
+    for (i = 0; i < n; ++i) {
+      r = snprintf(buf + l, len - l, "%zu %s - %s\n", offset + i,
+                   sp_artist_name(sp_track_artist(tracks[i], 0)),
+                   sp_track_name(tracks[i]));
+      if (r >= len - l)
+        return l;
+      l += r;
+    }
 
-      t = time(NULL) - stamp;
-      a = sp_track_artist(current_track, 0);
-      return sprintf(buf, "%s - %s %02d:%02d",
-                     sp_artist_name(a),
-                     sp_track_name(current_track),
-                     t / 60, t % 60);
+    offset += n;
+    count -= n;
+  }
+
+  return l < len ? l : len - 1;
 }
 
 /*
@@ -343,149 +616,175 @@ char *load_blob()
  * Server
  * =============================================================================
  */
-static int server_start()
-{
-  struct sockaddr_in addr;
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(1025);
-  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-
-  int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  if (fd < 0) {
-    perror("socket");
-    exit(EXIT_FAILURE);
-  }
-
-  if (bind(fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)) < 0) {
-    perror("bind");
-    exit(EXIT_FAILURE);
-  }
-
-  fprintf(log_fd, "Server started\n");
-  return fd;
-}
-
-static int server_recv(int fd, char **payload, int *len, struct sockaddr *addr, socklen_t *addrlen)
-{
-  int l;
-
-  l = recvfrom(fd, &socket_buf, 1024, MSG_DONTWAIT, addr, addrlen);
-  if (l <= 0)
-    return -1;
-
-  *len = socket_buf[1] << 8 | socket_buf[2];
-  if (*len > l || *len >= 1020)
-    return -1;
-
-  socket_buf[*len + 3] = '\0';
-  *payload = socket_buf + 3;
-
-  fprintf(log_fd, "Recvd: %d %s\n", socket_buf[0], socket_buf + 3);
-  fflush(log_fd);
-
-  return socket_buf[0];
-}
-
-static int server_send(int fd, char type, char *payload, int len, struct sockaddr *addr, socklen_t addrlen)
-{
-  socket_buf[0] = type;
-  socket_buf[1] = (char) ((len >> 8) & 0xFF00);
-  socket_buf[2] = (char) (len & 0xFF);
-
-  if (len)
-    strncpy(socket_buf + 3, payload, len);
-
-  fprintf(log_fd, "Send: %d %s\n", type, payload);
-  fflush(log_fd);
-
-  return sendto(fd, socket_buf, len + 3, 0, addr, addrlen);
-}
-
-static void server_handle_event(int fd)
+int server_command(int cmd, char *payload, int len, char *reply, int size, int *rlen)
 {
+  static uint32_t trace_ids;
   struct event *event, *ep;
 
-  struct sockaddr addr;
-  socklen_t addrlen;
+  unsigned long from, to;
+  sp_track *track;
+  char *end;
+  int i;
 
-  char buf[1000], *payload;
-  int len = 0;
+  *rlen = 0;
 
-  int cmd = server_recv(fd, &payload, &len, &addr, &addrlen);
   switch (cmd) {
   case QUIT:
     state = STATE_SHUTDOWN;
     break;
 
   case STATUS:
-    if (current_track) {
-      len = format_current_track(buf, 1000);
-      server_send(fd, 0, buf, len, &addr, addrlen);
+    if (playing_track) {
+      *rlen = format_current_track(reply, size);
     } else {
-      server_send(fd, 0, "stopped", 7, &addr, addrlen);
+      strcpy(reply, "stopped");
+      *rlen = 7;
     }
     break;
 
+  case STATS:
+    *rlen = audio_format_stats(reply, size);
+    *rlen += format_memory(reply + *rlen, size - *rlen);
+    break;
+
+  case TRACE:
+    i = trace_dump(trace_path);
+    if (i < 0)
+      log_error("Failed to write %s", trace_path);
+    *rlen = i < 0 ? snprintf(reply, size, "failed to write %s", trace_path) :
+                    snprintf(reply, size, "%d spans in %s", i, trace_path);
+    if (*rlen >= size)
+      *rlen = size - 1;
+    if (i < 0)
+      return PROTO_ERROR;
+    break;
+
   case CLEAR:
     clear_queue();
     while (event_queue) {
       ep = event_queue;
       event_queue = event_queue->next;
-      free(ep->data);
-      free(ep);
+      event_free(ep);
     }
+    event_tail = &event_queue;
     break;
 
+  case REMOVE:
+    errno = 0;
+    from = strtoul(len ? payload : "", &end, 10);
+    if (!len || *payload < '0' || *payload > '9' || *end || errno ||
+        from >= tracklist_len(&track_queue)) {
+      log_warn("Bad remove: %s", len ? payload : "");
+      return PROTO_ERROR;
+    }
+    track = tracklist_remove(&track_queue, from);
+    sp_track_release(track);
+    prefetched = 0;
+    queue_changed = 1;
+    break;
+
+  case MOVE:
+    if (sscanf(len ? payload : "", "%lu %lu", &from, &to) != 2 ||
+        tracklist_move(&track_queue, from, to) < 0) {
+      log_warn("Bad move: %s", len ? payload : "");
+      return PROTO_ERROR;
+    }
+    prefetched = 0;
+    queue_changed = 1;
+    break;
+
+  case SHUFFLE:
+    tracklist_shuffle(&track_queue);
+    prefetched = 0;
+    queue_changed = 1;
+    break;
+
+  case QLIST:
+    from = 0;
+    to = 20;
+    if (len)
+      sscanf(payload, "%lu %lu", &from, &to);
+    *rlen = format_queue(reply, size, from, to);
+    break;
+
+  case INSERT:
   case QUEUE:
   case PUSH:
   case NEXT:
-    event = malloc(sizeof(struct event));
+    from = (unsigned long) -1;
+    if (cmd == INSERT) {
+      from = strtoul(len ? payload : "", &end, 10);
+      if (!len || end == payload || *end != ' ') {
+        log_warn("Bad insert: %s", len ? payload : "");
+        return PROTO_ERROR;
+      }
+      payload = end + 1;
+    }
+    if (cmd != NEXT && !len)
+      return PROTO_ERROR;
+
+    /*
+     * Replies go out before links resolve, so refuse here what is unlikely
+     * to fit: besides the event itself, hold a queue entry for it and for
+     * every event still pending. Only collections can overrun that.
+     */
+    if (sizeof(struct event) + len + 1 + tracklist_bytes(event_count + 1) > mem_free()) {
+      log_warn("Over memory budget, rejecting command %d", cmd);
+      return PROTO_FULL;
+    }
+
+    event = calloc(1, sizeof(struct event));
+    if (!event)
+      abort();
     event->type = cmd;
     event->data = len ? strdup(payload) : NULL;
-    event->next = NULL;
+    event->state = EVENT_NEW;
+    event->pos = from;
+    event->trace_id = ++trace_ids;
+    event->queued = trace_now();
 
-    if (!event_queue) {
-      event_queue = event;
-    } else {
-      for (ep = event_queue; ep->next; ep = ep->next)
-        ;
-      ep->next = event;
-    }
+    event_bytes += sizeof(*event) + (event->data ? strlen(event->data) + 1 : 0);
+    ++event_count;
+
+    *event_tail = event;
+    event_tail = &event->next;
+
+    if (state == STATE_READY)
+      event_resolve(event);
+    break;
+
+  default:
+    return PROTO_UNKNOWN;
   }
+
+  return PROTO_OK;
 }
 
 static void server_process_events()
 {
-  struct event *event = event_queue;
-
-  if (!event)
-    return;
-
-  switch (event->type) {
-  case QUEUE:
-    if (queue_link(event->data) == 0) {
-      event_queue = event->next;
-      free(event->data);
-      free(event);
-    }
-    break;
-
-  case PUSH:
-    if (push_link(event->data) == 0) {
-      event_queue = event->next;
-      free(event->data);
-      free(event);
+  struct event *e;
+  time_t now = time(NULL);
+
+  for (e = event_queue; e; e = e->next) {
+    if (e->state == EVENT_NEW) {
+      event_resolve(e);
+    } else if (e->state == EVENT_LOADING && now - e->stamp >= RESOLVE_TIMEOUT) {
+      log_warn("Timed out loading: %s", e->data);
+      e->state = EVENT_FAILED;
+      e->settled = trace_now();
     }
-    break;
+  }
 
-  case NEXT:
-    next_track();
-    event_queue = event->next;
-    free(event->data);
-    break;
+  while ((e = event_queue) && e->state != EVENT_LOADING) {
+    event_queue = e->next;
+    if (!event_queue)
+      event_tail = &event_queue;
 
-  default:
-    break;
+    trace_span(TRACE_LOAD, e->resolving, e->settled, e->trace_id, e->data);
+    if (e->state == EVENT_READY)
+      event_apply(e);
+    trace_span(TRACE_APPLY, e->settled, trace_now(), e->trace_id, e->data);
+    event_free(e);
   }
 }
 
@@ -498,7 +797,7 @@ static void server_process_events()
 static void playlist_state_changed(sp_playlist *pl, void *userdata)
 {
   if (sp_playlist_is_loaded(pl))
-    fprintf(log_fd, "Playlist Loaded: %s\n", sp_playlist_name(pl));
+    log_debug("Playlist Loaded: %s", sp_playlist_name(pl));
 }
 
 static void playlist_added(sp_playlistcontainer *pc, sp_playlist *pl, int p, void *userdata)
@@ -512,16 +811,15 @@ static void playlist_added(sp_playlistcontainer *pc, sp_playlist *pl, int p, voi
 
 static void playlist_removed(sp_playlistcontainer *pc, sp_playlist *pl, int p, void *userdata)
 {
-  fprintf(log_fd, "Playlist removed: %s\n", sp_playlist_name(pl));
+  log_debug("Playlist removed: %s", sp_playlist_name(pl));
 }
 
 static void container_loaded(sp_playlistcontainer *pc, void *userdata)
 {
   if (state != STATE_READY) {
     state = STATE_READY;
-    fprintf(log_fd, "Ready!\n");
-    fprintf(log_fd, "Found %d playlists\n", sp_playlistcontainer_num_playlists(pc));
-    fflush(log_fd);
+    log_info("Ready!");
+    log_info("Found %d playlists", sp_playlistcontainer_num_playlists(pc));
   }
 }
 
@@ -535,10 +833,10 @@ static void credentials_blob_updated(sp_session *session, const char *blob)
   fd = fopen(filename, "w");
   if (fd) {
     if (fputs(blob, fd) == EOF)
-      fprintf(log_fd, "Failed to update blob\n");
+      log_error("Failed to update blob");
     fclose(fd);
   } else {
-    fprintf(log_fd, "Failed to update blob\n");
+    log_error("Failed to update blob");
   }
 
 }
@@ -555,8 +853,8 @@ static void connectionstate_updated(sp_session *session)
   };
 
   cs = sp_session_connectionstate(session);
-  fprintf(log_fd, "Connection State: %d\n", cs);
-  fflush(log_fd);
+  log_info("Connection State: %d", cs);
+  metrics_connection(cs);
 
   if (cs == SP_CONNECTION_STATE_LOGGED_IN) {
     pc = sp_session_playlistcontainer(session);
@@ -573,18 +871,17 @@ static void connectionstate_updated(sp_session *session)
 
 static void message_to_user(sp_session *session, const char *msg)
 {
-  fprintf(log_fd, "Message to user: %s\n", msg);
+  log_info("Message to user: %s", msg);
 }
 
 static void connection_error(sp_session *session, sp_error error)
 {
-  fprintf(log_fd, "Connection error: %s\n", sp_error_message(error));
+  log_error("Connection error: %s", sp_error_message(error));
 }
 
 static void logger(sp_session *session, const char *data)
 {
-  fprintf(log_fd, "Log: %s", data);
-  fflush(log_fd);
+  log_debug("Log: %s", data);
 }
 
 static void finish(int sig)
@@ -592,34 +889,55 @@ static void finish(int sig)
   sp_session_logout(session);
   audio_stop();
 
-  close(socket_fd);
-  fclose(log_fd);
+  server_stop();
+  metrics_stop();
+  status_destroy();
+  log_stop();
 
   exit(0);
 }
 
 static void notify_main_thread(sp_session *session)
 {
-  pthread_mutex_lock(&notify_mutex);
-  notify_events = 1;
-  pthread_cond_signal(&notify_cond);
-  pthread_mutex_unlock(&notify_mutex);
+  uint64_t one = 1;
+
+  if (write(notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("notify");
+}
+
+/* Runs on the audio thread: publish_events() has a track change to make */
+static void track_reached()
+{
+  notify_main_thread(session);
 }
 
 static void get_audio_buffer_stats(sp_session *session, sp_audio_buffer_stats *stats)
 {
   stats->samples = audio_buffered();
-  stats->stutter = 0;
+  stats->stutter = audio_stutter();
 }
 
 static int music_delivery(sp_session *session, const sp_audioformat *format, const void *frames, int num_frames)
 {
-  return audio_push(frames, num_frames, format->sample_rate, format->channels, 16);
+  static uint32_t traced;
+  static int named;
+  int n;
+
+  if (!named) {
+    trace_thread("spotify");
+    named = 1;
+  }
+
+  n = audio_push(frames, num_frames, format->sample_rate, format->channels, 16);
+  if (n > 0)
+    trace_track_reached(TRACE_FIRST_DELIVERY, &traced);
+  return n;
 }
 
 static void end_of_track(sp_session *session)
 {
-  next_track();
+  atomic_store(&track_ended, 1);
+  notify_main_thread(session);
 }
 
 static int process_events(sp_session *session)
@@ -627,51 +945,280 @@ static int process_events(sp_session *session)
   int next_timeout = 0;
 
   do {
-    pthread_mutex_unlock(&notify_mutex);
     sp_session_process_events(session, &next_timeout);
-    pthread_mutex_lock(&notify_mutex);
   } while (next_timeout == 0);
 
-  notify_events = 0;
   return next_timeout;
 }
 
+/*
+ * Milliseconds until prefetch_track() has something to do, or -1.
+ */
+static int prefetch_due()
+{
+  long ms;
+
+  if (state != STATE_READY || prefetched || !current_track ||
+      !tracklist_len(&track_queue))
+    return -1;
+
+  ms = (stamp - time(NULL)) * 1000 + sp_track_duration(current_track) - PREFETCH_MS;
+  return ms > 0 ? ms : 0;
+}
+
+static int64_t now_ms()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Arm timer_fd for the earliest of libspotify's next deadline, the next
+ * prefetch, the next link timeout and the next position tick, so the loop
+ * sleeps exactly until one of them is due.
+ */
+static void arm_timer(int64_t deadline)
+{
+  struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+  int64_t ms = deadline - now_ms();
+  int prefetch = prefetch_due();
+  int events = state == STATE_READY ? events_due() : -1;
+  int tick = playing_track ? server_tick_due(now_ms()) : -1;
+
+  if (ms < 0)
+    ms = 0;
+  if (prefetch >= 0 && prefetch < ms)
+    ms = prefetch;
+  if (events >= 0 && events < ms)
+    ms = events;
+  if (tick >= 0 && tick < ms)
+    ms = tick;
+
+  /* A zero it_value would disarm the timer */
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (ms % 1000) * 1000000L + 1;
+
+  timerfd_settime(timer_fd, 0, &its, NULL);
+}
+
+/*
+ * Tell subscribers and the status page what changed since the last loop
+ * iteration. Changes are coalesced, so a batch of QUEUEs makes a single
+ * queue event. A new track only counts once it is the one being heard.
+ */
+static void publish_events()
+{
+  static unsigned long xruns;
+  static int buffer_ms;
+
+  struct audio_stats st;
+  char buf[1000];
+  int len, events = server_events();
+
+  if (track_pending && audio_track_reached() == track_mark) {
+    if (playing_track)
+      sp_track_release(playing_track);
+    playing_track = current_track;
+    if (playing_track)
+      sp_track_add_ref(playing_track);
+    track_pending = 0;
+    track_changed = 1;
+  }
+
+  if (track_changed && playing_track)
+    status_set_player(1, sp_track_name(playing_track),
+                      sp_artist_name(sp_track_artist(playing_track, 0)),
+                      sp_track_duration(playing_track), tracklist_len(&track_queue));
+  else if (track_changed)
+    status_set_player(0, NULL, NULL, 0, tracklist_len(&track_queue));
+  else if (queue_changed)
+    status_set_queue(tracklist_len(&track_queue));
+
+  if ((events & PROTO_EV_TRACK) && track_changed) {
+    if (playing_track) {
+      len = format_current_track(buf, sizeof(buf));
+      server_publish(PROTO_EV_TRACK, buf, len);
+    } else {
+      server_publish(PROTO_EV_TRACK, "stopped", 7);
+    }
+  }
+
+  if ((events & PROTO_EV_QUEUE) && queue_changed) {
+    len = snprintf(buf, sizeof(buf), "%zu tracks", tracklist_len(&track_queue));
+    server_publish(PROTO_EV_QUEUE, buf, len);
+  }
+
+  track_changed = queue_changed = 0;
+
+  if (events & PROTO_EV_BUFFER) {
+    audio_get_stats(&st);
+    if (st.xruns != xruns || st.buffer_ms != buffer_ms) {
+      xruns = st.xruns;
+      buffer_ms = st.buffer_ms;
+      len = snprintf(buf, sizeof(buf), "%d ms %lu xruns", buffer_ms, xruns);
+      server_publish(PROTO_EV_BUFFER, buf, len);
+    }
+  }
+
+  if (playing_track && server_tick_due(now_ms()) == 0) {
+    len = snprintf(buf, sizeof(buf), "%ld %d", audio_position_ms(),
+                   sp_track_duration(playing_track));
+    server_tick(now_ms(), buf, len);
+  }
+}
+
+static void epoll_watch(int epfd, int fd)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    perror("epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void log_audio_thread()
+{
+  struct audio_stats st;
+
+  audio_get_stats(&st);
+
+  log_info("Audio thread: %s priority %d, %s, memory %s",
+          st.rt_policy == SCHED_FIFO ? "SCHED_FIFO" :
+          st.rt_policy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER",
+          st.rt_priority,
+          st.rt_pinned ? "pinned" : "unpinned",
+          st.rt_locked ? "locked" : "unlocked");
+}
+
 static void main_loop()
 {
-  int next_timeout;
+  struct epoll_event events[8];
+  uint64_t count;
+  int64_t deadline = 0;
+  int epfd, n, i, spotify;
 
-  struct pollfd fds[1];
-  fds[0].fd = socket_fd;
-  fds[0].events = POLLIN;
+  trace_thread("main");
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    perror("epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+
+  if (server_start(epfd, socket_path) < 0)
+    exit(EXIT_FAILURE);
+  metrics_start(epfd, metrics_port);
+  epoll_watch(epfd, notify_fd);
+  epoll_watch(epfd, timer_fd);
 
   audio_start();
-  pthread_mutex_lock(&notify_mutex);
+  log_audio_thread();
 
   state = STATE_STARTED;
-  next_timeout = 0;
+  spotify = 1;
   while (state) {
-    if (next_timeout || notify_events)
-      next_timeout = process_events(session);
+    if (spotify)
+      deadline = now_ms() + process_events(session);
 
-    pthread_mutex_unlock(&notify_mutex);
+    if (atomic_exchange(&track_ended, 0))
+      advance_track();
 
-    if (next_timeout == 0 || next_timeout > 200)
-      next_timeout = 200;
+    if (state == STATE_READY) {
+      server_process_events();
+      prefetch_track();
+    }
 
-    fds[0].revents = 0;
-    if (poll(fds, 1, next_timeout) > 0)
-      server_handle_event(socket_fd);
+    publish_events();
 
-    if (state == STATE_READY)
-      server_process_events();
+    arm_timer(deadline);
+
+    n = epoll_wait(epfd, events, 8, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      break;
+    }
 
-    pthread_mutex_lock(&notify_mutex);
+    spotify = 0;
+    for (i = 0; i < n; ++i) {
+      if (events[i].data.fd == notify_fd || events[i].data.fd == timer_fd) {
+        /* Both mean libspotify wants to run */
+        if (read(events[i].data.fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+          perror("read");
+        spotify = 1;
+      } else if (server_handle(events[i].data.fd, events[i].events) < 0) {
+        metrics_handle(events[i].data.fd, events[i].events);
+      }
+    }
   }
 
-  pthread_mutex_unlock(&notify_mutex);
+  close(epfd);
   audio_stop();
 }
 
+static int parse_sched(const char *arg, struct audio_config *c)
+{
+  char policy[8];
+
+  if (sscanf(arg, "%7[a-z]:%d", policy, &c->rt_priority) != 2)
+    return -1;
+
+  if (strcmp(policy, "fifo") == 0)
+    c->rt_policy = SCHED_FIFO;
+  else if (strcmp(policy, "rr") == 0)
+    c->rt_policy = SCHED_RR;
+  else
+    return -1;
+
+  return 0;
+}
+
+static int parse_cpus(const char *arg, unsigned long *mask)
+{
+  char *end;
+  long cpu;
+
+  *mask = 0;
+  do {
+    cpu = strtol(arg, &end, 10);
+    if (end == arg || cpu < 0 || cpu >= (long) sizeof(*mask) * 8)
+      return -1;
+    *mask |= 1UL << cpu;
+    arg = end + 1;
+  } while (*end == ',');
+
+  return *end ? -1 : 0;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "%s [-o output] [-r rate] [-c channels] [-b low:high] [-R policy:prio]\n"
+                  "    [-C cpus] [-L] [-S socket] [-M mb] [-P port] [-l log] [-T trace] [-v]\n"
+                  "    username [password]\n", prog);
+  fprintf(stderr, "  -o output    alsa[:device], null[:fast], wav:file or pipe[:file|-]\n");
+  fprintf(stderr, "  -r rate      open the output once at this rate and convert to it\n");
+  fprintf(stderr, "  -c channels  output channels when -r is given (default 2)\n");
+  fprintf(stderr, "  -b low:high  audio buffer watermarks in ms (default 1000:4000)\n");
+  fprintf(stderr, "  -R fifo|rr:prio  real-time scheduling for the audio thread\n");
+  fprintf(stderr, "  -C cpu[,cpu]  pin the audio thread to these CPUs\n");
+  fprintf(stderr, "  -L           lock the audio buffers into memory\n");
+  fprintf(stderr, "  -S socket    control socket path (default " SERVER_PATH ")\n");
+  fprintf(stderr, "  -M mb        memory budget for queues and audio, 0 for none (default %d)\n",
+          MEM_BUDGET_MB);
+  fprintf(stderr, "  -P port      serve Prometheus metrics on 127.0.0.1:port, 0 for none (default %d)\n",
+          METRICS_PORT);
+  fprintf(stderr, "  -l log       log file, rotated at 4 MB (default ./log)\n");
+  fprintf(stderr, "  -T trace     where the trace command writes its JSON (default ./trace.json)\n");
+  fprintf(stderr, "  -v           log debug messages too, such as every command\n");
+  exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv)
 {
   sp_error err;
@@ -680,38 +1227,116 @@ int main(int argc, char **argv)
   char *blob;
   char *cachepath;
 
-  pthread_cond_init(&notify_cond, NULL);
-  pthread_mutex_init(&notify_mutex, NULL);
+  struct audio_config audio_config = { 0 };
+  struct audio_stats audio_stats;
+  const char *log_path = "log";
+  uint32_t seed;
+  int verbose = 0;
+  int opt;
+
+  notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (notify_fd < 0 || timer_fd < 0) {
+    perror("eventfd");
+    exit(EXIT_FAILURE);
+  }
+
+  while ((opt = getopt(argc, argv, "o:r:c:b:R:C:LS:M:P:l:T:v")) != -1) {
+    switch (opt) {
+    case 'o':
+      audio_config.output = optarg;
+      break;
+    case 'r':
+      audio_config.rate = atoi(optarg);
+      break;
+    case 'c':
+      audio_config.channels = atoi(optarg);
+      break;
+    case 'b':
+      if (sscanf(optarg, "%d:%d", &audio_config.buffer_min_ms,
+                 &audio_config.buffer_max_ms) < 1)
+        usage(argv[0]);
+      break;
+    case 'R':
+      if (parse_sched(optarg, &audio_config) < 0)
+        usage(argv[0]);
+      break;
+    case 'C':
+      if (parse_cpus(optarg, &audio_config.cpu_mask) < 0)
+        usage(argv[0]);
+      break;
+    case 'L':
+      audio_config.mlock = 1;
+      break;
+    case 'S':
+      socket_path = optarg;
+      break;
+    case 'M':
+      mem_budget = (size_t) atoi(optarg) << 20;
+      break;
+    case 'l':
+      log_path = optarg;
+      break;
+    case 'T':
+      trace_path = optarg;
+      break;
+    case 'P':
+      metrics_port = atoi(optarg);
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
 
   cachepath = cache_dir();
   blob = load_blob();
 
-  if (argc < 2) {
-    fprintf(stderr, "%s username [password]\n", argv[0]);
+  if (argc - optind < 1)
+    usage(argv[0]);
+
+  if (!blob && argc - optind < 2)
+    usage(argv[0]);
+
+  username = argv[optind];
+  password = blob ? NULL : argv[optind + 1];
+
+  if (log_start(log_path, verbose ? LOG_DEBUG : LOG_INFO) < 0)
     exit(EXIT_FAILURE);
-  }
+  cache_dir(cachepath);
 
-  if (!blob && argc < 3) {
-    fprintf(stderr, "%s username [password]\n", argv[0]);
+  audio_config.track_reached = track_reached;
+  if (audio_init(&audio_config) < 0) {
+    fprintf(stderr, "Failed to initialize audio\n");
+    exit(EXIT_FAILURE);
+  }
+  audio_get_stats(&audio_stats);
+  audio_bytes = audio_stats.ring_bytes;
+  if (mem_budget && audio_bytes > mem_budget) {
+    fprintf(stderr, "The audio buffer alone (%zu KB) exceeds the memory budget, "
+                    "lower -b or raise -M\n", audio_bytes >> 10);
     exit(EXIT_FAILURE);
   }
 
-  username = argv[1];
-  password = blob ? NULL : argv[2];
-
-  log_fd = fopen("log", "w");
-  cache_dir(cachepath);
+  /* Otherwise SHUFFLE would deal the same order after every start */
+  if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed))
+    seed = time(NULL) ^ getpid();
+  tracklist_seed(&track_queue, seed);
 
-  audio_init();
+  if (status_create(STATUS_NAME) < 0)
+    log_warn("Running without a status page");
   signal(SIGINT, finish);
-
-  notify_events = 0;
+  /* A reader going away is an error return, not a reason to die */
+  signal(SIGPIPE, SIG_IGN);
 
   sp_session_callbacks session_callbacks = {
     .notify_main_thread       = &notify_main_thread,
     .music_delivery           = &music_delivery,
     .get_audio_buffer_stats   = &get_audio_buffer_stats,
     .end_of_track             = &end_of_track,
+    .metadata_updated         = &metadata_updated,
     .log_message              = &logger,
     .message_to_user          = &message_to_user,
     .connection_error         = &connection_error,
@@ -744,11 +1369,8 @@ int main(int argc, char **argv)
     exit(EXIT_FAILURE);
   }
 
-  socket_fd = server_start();
-
   main_loop();
 
-  pthread_mutex_unlock(&notify_mutex);
   finish(0);
 
   return 0;
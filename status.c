@@ -0,0 +1,184 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "status.h"
+
+static struct status_page *page;
+static char page_name[64];
+
+static int64_t now_ms()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int status_create(const char *name)
+{
+  void *p;
+  int fd;
+
+  fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("shm_open");
+    return -1;
+  }
+
+  if (ftruncate(fd, sizeof(struct status_page)) < 0) {
+    perror("ftruncate");
+    close(fd);
+    return -1;
+  }
+
+  p = mmap(NULL, sizeof(struct status_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+
+  page = p;
+  page->version = STATUS_VERSION;
+  atomic_thread_fence(memory_order_release);
+  page->magic = STATUS_MAGIC;
+  snprintf(page_name, sizeof(page_name), "%s", name);
+  return 0;
+}
+
+void status_destroy()
+{
+  if (!page)
+    return;
+
+  munmap(page, sizeof(struct status_page));
+  shm_unlink(page_name);
+  page = NULL;
+}
+
+static void write_begin(atomic_uint *seq)
+{
+  atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1,
+                        memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+static void write_end(atomic_uint *seq)
+{
+  atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1,
+                        memory_order_release);
+}
+
+void status_set_player(int playing, const char *track, const char *artist,
+                       unsigned int duration_ms, unsigned int queue_len)
+{
+  if (!page)
+    return;
+
+  write_begin(&page->player_seq);
+  page->playing = playing;
+  page->queue_len = queue_len;
+  page->duration_ms = duration_ms;
+  snprintf(page->track, sizeof(page->track), "%s", track ? track : "");
+  snprintf(page->artist, sizeof(page->artist), "%s", artist ? artist : "");
+  write_end(&page->player_seq);
+}
+
+void status_set_queue(unsigned int queue_len)
+{
+  if (!page)
+    return;
+
+  write_begin(&page->player_seq);
+  page->queue_len = queue_len;
+  write_end(&page->player_seq);
+}
+
+void status_set_audio(unsigned int buffer_ms, unsigned long frames, unsigned long xruns,
+                      unsigned int position_ms, unsigned int ahead_ms)
+{
+  if (!page)
+    return;
+
+  write_begin(&page->audio_seq);
+  page->buffer_ms = buffer_ms;
+  page->frames = frames;
+  page->xruns = xruns;
+  page->position_ms = position_ms;
+  page->ahead_ms = ahead_ms;
+  page->at_ms = now_ms();
+  write_end(&page->audio_seq);
+}
+
+const struct status_page *status_open(const char *name)
+{
+  const struct status_page *p;
+  int fd;
+
+  fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+    return NULL;
+
+  p = mmap(NULL, sizeof(struct status_page), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return NULL;
+
+  if (p->magic != STATUS_MAGIC || p->version != STATUS_VERSION) {
+    munmap((void *) p, sizeof(struct status_page));
+    return NULL;
+  }
+
+  return p;
+}
+
+/*
+ * Seqlock read: copy the section, retry if the writer was in it.
+ */
+void status_read(const struct status_page *p, struct status *st)
+{
+  atomic_uint *seq;
+  unsigned int s, position, ahead;
+  int64_t at, now;
+
+  seq = (atomic_uint *) &p->player_seq;
+  do {
+    while ((s = atomic_load_explicit(seq, memory_order_acquire)) & 1)
+      ;
+    st->playing = p->playing;
+    st->queue_len = p->queue_len;
+    st->duration_ms = p->duration_ms;
+    memcpy(st->track, p->track, sizeof(st->track));
+    memcpy(st->artist, p->artist, sizeof(st->artist));
+    atomic_thread_fence(memory_order_acquire);
+  } while (atomic_load_explicit(seq, memory_order_relaxed) != s);
+
+  st->track[sizeof(st->track) - 1] = '\0';
+  st->artist[sizeof(st->artist) - 1] = '\0';
+  seq = (atomic_uint *) &p->audio_seq;
+  do {
+    while ((s = atomic_load_explicit(seq, memory_order_acquire)) & 1)
+      ;
+    st->buffer_ms = p->buffer_ms;
+    st->frames = p->frames;
+    st->xruns = p->xruns;
+    position = p->position_ms;
+    ahead = p->ahead_ms;
+    at = p->at_ms;
+    atomic_thread_fence(memory_order_acquire);
+  } while (atomic_load_explicit(seq, memory_order_relaxed) != s);
+
+  /* The device keeps playing what was written after the last update */
+  now = now_ms();
+  if (now - at < ahead)
+    ahead = now > at ? now - at : 0;
+
+  st->position_ms = st->playing ? position + ahead : 0;
+  if (st->position_ms > st->duration_ms)
+    st->position_ms = st->duration_ms;
+}
@@ -0,0 +1,69 @@
+#ifndef _STATUS_H_
+#define _STATUS_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * Status page: a small shm_open() segment that co-located readers map
+ * once and then read without any syscalls or load on the control server.
+ *
+ * The player section is written by the main thread and the audio section
+ * by the audio thread. Each has its own sequence counter (a seqlock: odd
+ * while an update is in progress), so each has exactly one writer and
+ * neither ever waits for the other.
+ */
+#define STATUS_NAME    "/smd-status"
+#define STATUS_MAGIC   0x534d4431
+#define STATUS_VERSION 2
+
+struct status_page {
+  uint32_t magic;
+  uint32_t version;
+
+  _Alignas(64) atomic_uint player_seq;
+  int32_t playing;
+  uint32_t queue_len;
+  uint32_t duration_ms;
+  char track[256];
+  char artist[256];
+
+  _Alignas(64) atomic_uint audio_seq;
+  uint32_t buffer_ms;
+  uint64_t frames;
+  uint64_t xruns;
+
+  /* Heard at at_ms (CLOCK_MONOTONIC), and written beyond that */
+  uint32_t position_ms;
+  uint32_t ahead_ms;
+  int64_t at_ms;
+};
+
+/* A consistent copy of the page */
+struct status {
+  int playing;
+  unsigned int queue_len;
+  unsigned int duration_ms;
+  unsigned int position_ms;
+  char track[256];
+  char artist[256];
+
+  unsigned int buffer_ms;
+  unsigned long frames;
+  unsigned long xruns;
+};
+
+/* Writer side: create the page; updates are no-ops if this failed */
+int  status_create(const char *name);
+void status_destroy();
+void status_set_player(int playing, const char *track, const char *artist,
+                       unsigned int duration_ms, unsigned int queue_len);
+void status_set_queue(unsigned int queue_len);
+void status_set_audio(unsigned int buffer_ms, unsigned long frames, unsigned long xruns,
+                      unsigned int position_ms, unsigned int ahead_ms);
+
+/* Reader side */
+const struct status_page *status_open(const char *name);
+void status_read(const struct status_page *page, struct status *st);
+
+#endif
@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#define TRACE_SPANS   4096
+#define TRACE_LABEL   36
+#define TRACE_THREADS 8
+
+/*
+ * seq is the ring index plus one once the span is complete, 0 while it is
+ * being written.
+ */
+struct span {
+  atomic_ulong seq;
+  uint64_t start;
+  uint64_t end;
+  uint32_t id;
+  int32_t tid;
+  uint8_t stage;
+  char label[TRACE_LABEL];
+};
+
+struct thread {
+  atomic_int tid;
+  const char *name;
+};
+
+static struct span spans[TRACE_SPANS];
+static atomic_ulong head;
+
+static struct thread threads[TRACE_THREADS];
+static atomic_int nthreads;
+static __thread int tid;
+
+static atomic_uint track_id;
+static atomic_ulong track_ns;
+
+static const char *stages[] = {
+  "recv", "queued", "load", "apply", "player_load", "first_delivery", "first_write"
+};
+
+uint64_t trace_now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int thread_id()
+{
+  if (!tid)
+    tid = syscall(SYS_gettid);
+  return tid;
+}
+
+void trace_span(int stage, uint64_t start, uint64_t end, uint32_t id, const char *label)
+{
+  unsigned long i = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+  struct span *s = &spans[i % TRACE_SPANS];
+
+  atomic_store_explicit(&s->seq, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  s->start = start;
+  s->end = end;
+  s->id = id;
+  s->tid = thread_id();
+  s->stage = stage;
+  if (label) {
+    strncpy(s->label, label, TRACE_LABEL - 1);
+    s->label[TRACE_LABEL - 1] = '\0';
+  } else {
+    s->label[0] = '\0';
+  }
+
+  atomic_store_explicit(&s->seq, i + 1, memory_order_release);
+}
+
+void trace_thread(const char *name)
+{
+  int n = atomic_fetch_add(&nthreads, 1);
+
+  if (n >= TRACE_THREADS)
+    return;
+
+  threads[n].name = name;
+  atomic_store_explicit(&threads[n].tid, thread_id(), memory_order_release);
+}
+
+uint32_t trace_track_start()
+{
+  atomic_store(&track_ns, trace_now());
+  return atomic_fetch_add(&track_id, 1) + 1;
+}
+
+uint32_t trace_track()
+{
+  return atomic_load(&track_id);
+}
+
+void trace_track_reached(int stage, uint32_t *seen)
+{
+  uint32_t id = atomic_load(&track_id);
+
+  if (!id || *seen == id)
+    return;
+
+  *seen = id;
+  trace_span(stage, atomic_load(&track_ns), trace_now(), id, NULL);
+}
+
+static void write_string(FILE *fp, const char *s)
+{
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\')
+      fprintf(fp, "\\%c", *s);
+    else if ((unsigned char) *s < 0x20)
+      fprintf(fp, "\\u%04x", *s);
+    else
+      fputc(*s, fp);
+  }
+}
+
+/* Drop a multibyte character cut off by the label's length */
+static void trim_utf8(char *s)
+{
+  size_t n = strlen(s), i = n;
+  unsigned char c;
+
+  while (i > 0 && ((unsigned char) s[i - 1] & 0xC0) == 0x80)
+    --i;
+  if (i == 0 || (c = s[i - 1]) < 0xC0)
+    return;
+  if (n - (i - 1) < (size_t) (c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2))
+    s[i - 1] = '\0';
+}
+
+/*
+ * Complete ("X") events, timestamps in microseconds. Spans overwritten
+ * while being copied are left out.
+ */
+int trace_dump(const char *path)
+{
+  unsigned long h = atomic_load(&head), i;
+  const char *sep = "";
+  struct span s;
+  FILE *fp;
+  int n = 0, t;
+
+  fp = fopen(path, "w");
+  if (!fp)
+    return -1;
+
+  fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+  for (t = 0; t < atomic_load(&nthreads) && t < TRACE_THREADS; ++t, sep = ",\n")
+    fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}",
+            sep, atomic_load_explicit(&threads[t].tid, memory_order_acquire), threads[t].name);
+
+  for (i = h > TRACE_SPANS ? h - TRACE_SPANS : 0; i < h; ++i) {
+    if (atomic_load_explicit(&spans[i % TRACE_SPANS].seq, memory_order_acquire) != i + 1)
+      continue;
+    memcpy(&s, &spans[i % TRACE_SPANS], sizeof(s));
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&spans[i % TRACE_SPANS].seq, memory_order_relaxed) != i + 1)
+      continue;
+    s.label[TRACE_LABEL - 1] = '\0';
+    trim_utf8(s.label);
+
+    fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"id\":%u",
+            sep, stages[s.stage], s.tid,
+            s.start / 1000.0, (s.end > s.start ? s.end - s.start : 0) / 1000.0, s.id);
+    if (s.label[0]) {
+      fprintf(fp, ",\"label\":\"");
+      write_string(fp, s.label);
+      fputc('"', fp);
+    }
+    fprintf(fp, "}}");
+    sep = ",\n";
+    ++n;
+  }
+
+  fprintf(fp, "\n]}\n");
+  if (fclose(fp) != 0)
+    return -1;
+
+  return n;
+}
@@ -0,0 +1,42 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Pipeline tracing: spans with monotonic timestamps kept in a fixed ring,
+ * the oldest overwritten first, and dumped on request as Chrome trace_event
+ * JSON for chrome://tracing or Perfetto. trace_span() is a few stores and
+ * may be called from any thread.
+ *
+ * Commands carry an id through QUEUED, LOAD and APPLY. Track startups
+ * carry another from PLAYER_LOAD to FIRST_DELIVERY and FIRST_WRITE, which
+ * all start when play_track() does.
+ */
+#define TRACE_RECV           0  /* a control message, receipt to reply */
+#define TRACE_QUEUED         1  /* command waiting to be resolved */
+#define TRACE_LOAD           2  /* link loading until it succeeds or fails */
+#define TRACE_APPLY          3  /* loaded, waiting its turn to be applied */
+#define TRACE_PLAYER_LOAD    4  /* sp_session_player_load() */
+#define TRACE_FIRST_DELIVERY 5  /* until libspotify delivers the first frame */
+#define TRACE_FIRST_WRITE    6  /* until the output has been handed one */
+
+uint64_t trace_now();
+void trace_span(int stage, uint64_t start, uint64_t end, uint32_t id, const char *label);
+
+/* Name the calling thread in dumps */
+void trace_thread(const char *name);
+
+/*
+ * Track startups: trace_track_start() opens one and returns its id, which
+ * trace_track() reads back; trace_track_reached() records stage once per
+ * startup, seen being the caller's own memory of the last id it recorded.
+ */
+uint32_t trace_track_start();
+uint32_t trace_track();
+void trace_track_reached(int stage, uint32_t *seen);
+
+/* Write the ring to path, returns the number of spans or -1 */
+int trace_dump(const char *path);
+
+#endif
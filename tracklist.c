@@ -0,0 +1,329 @@
+#include <stdlib.h>
+
+#include "tracklist.h"
+
+struct tracklist_node {
+  void *item;
+  uint32_t prio;
+  size_t size;
+  struct tracklist_node *left, *right;
+};
+
+static uint32_t next_prio(struct tracklist *l)
+{
+  uint32_t x = l->seed ? l->seed : 0x9e3779b9;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return l->seed = x;
+}
+
+void tracklist_seed(struct tracklist *l, uint32_t seed)
+{
+  l->seed = seed;
+}
+
+static size_t size(const struct tracklist_node *t)
+{
+  return t ? t->size : 0;
+}
+
+static void update(struct tracklist_node *t)
+{
+  t->size = 1 + size(t->left) + size(t->right);
+}
+
+/*
+ * Split t into the first k items (*a) and the rest (*b).
+ */
+static void split(struct tracklist_node *t, size_t k,
+                  struct tracklist_node **a, struct tracklist_node **b)
+{
+  if (!t) {
+    *a = *b = NULL;
+  } else if (size(t->left) < k) {
+    split(t->right, k - size(t->left) - 1, &t->right, b);
+    update(t);
+    *a = t;
+  } else {
+    split(t->left, k, a, &t->left);
+    update(t);
+    *b = t;
+  }
+}
+
+static struct tracklist_node *merge(struct tracklist_node *a, struct tracklist_node *b)
+{
+  if (!a)
+    return b;
+  if (!b)
+    return a;
+
+  if (a->prio > b->prio) {
+    a->right = merge(a->right, b);
+    update(a);
+    return a;
+  }
+
+  b->left = merge(a, b->left);
+  update(b);
+  return b;
+}
+
+static void fix_sizes(struct tracklist_node *t)
+{
+  if (!t)
+    return;
+
+  fix_sizes(t->left);
+  fix_sizes(t->right);
+  update(t);
+}
+
+/*
+ * Build a treap over nodes already in order: the usual Cartesian tree
+ * construction with a stack of the right spine, O(n).
+ */
+static struct tracklist_node *build(struct tracklist_node **nodes, size_t n)
+{
+  struct tracklist_node **spine, *last;
+  size_t i, top = 0;
+
+  spine = malloc(n * sizeof(*spine));
+  if (!spine)
+    return NULL;
+
+  for (i = 0; i < n; ++i) {
+    last = NULL;
+    while (top && spine[top - 1]->prio < nodes[i]->prio)
+      last = spine[--top];
+
+    nodes[i]->left = last;
+    if (top)
+      spine[top - 1]->right = nodes[i];
+    spine[top++] = nodes[i];
+  }
+
+  last = spine[0];
+  free(spine);
+
+  fix_sizes(last);
+  return last;
+}
+
+static struct tracklist_node *new_node(struct tracklist *l, void *item)
+{
+  struct tracklist_node *t;
+
+  t = malloc(sizeof(*t));
+  if (!t)
+    return NULL;
+
+  t->item = item;
+  t->prio = next_prio(l);
+  t->size = 1;
+  t->left = t->right = NULL;
+  return t;
+}
+
+size_t tracklist_bytes(size_t n)
+{
+  return n * sizeof(struct tracklist_node);
+}
+
+size_t tracklist_len(const struct tracklist *l)
+{
+  return size(l->root);
+}
+
+void *tracklist_get(const struct tracklist *l, size_t pos)
+{
+  struct tracklist_node *t = l->root;
+
+  while (t) {
+    if (pos < size(t->left)) {
+      t = t->left;
+    } else if (pos == size(t->left)) {
+      return t->item;
+    } else {
+      pos -= size(t->left) + 1;
+      t = t->right;
+    }
+  }
+
+  return NULL;
+}
+
+int tracklist_insert(struct tracklist *l, size_t pos, void *item)
+{
+  return tracklist_insert_many(l, pos, &item, 1);
+}
+
+int tracklist_insert_many(struct tracklist *l, size_t pos, void **items, size_t n)
+{
+  struct tracklist_node **nodes, *a, *b;
+  size_t i;
+
+  if (n == 0)
+    return 0;
+
+  nodes = malloc(n * sizeof(*nodes));
+  if (!nodes)
+    return -1;
+
+  for (i = 0; i < n; ++i) {
+    nodes[i] = new_node(l, items[i]);
+    if (!nodes[i]) {
+      while (i--)
+        free(nodes[i]);
+      free(nodes);
+      return -1;
+    }
+  }
+
+  a = build(nodes, n);
+  if (!a) {
+    for (i = 0; i < n; ++i)
+      free(nodes[i]);
+    free(nodes);
+    return -1;
+  }
+  free(nodes);
+
+  if (pos > size(l->root))
+    pos = size(l->root);
+
+  split(l->root, pos, &l->root, &b);
+  l->root = merge(merge(l->root, a), b);
+  return 0;
+}
+
+void *tracklist_remove(struct tracklist *l, size_t pos)
+{
+  struct tracklist_node *a, *m, *b;
+  void *item;
+
+  if (pos >= size(l->root))
+    return NULL;
+
+  split(l->root, pos, &a, &b);
+  split(b, 1, &m, &b);
+  l->root = merge(a, b);
+
+  item = m->item;
+  free(m);
+  return item;
+}
+
+int tracklist_move(struct tracklist *l, size_t from, size_t to)
+{
+  struct tracklist_node *a, *m, *b;
+
+  if (from >= size(l->root) || to >= size(l->root))
+    return -1;
+
+  split(l->root, from, &a, &b);
+  split(b, 1, &m, &b);
+  a = merge(a, b);
+
+  split(a, to, &a, &b);
+  l->root = merge(merge(a, m), b);
+  return 0;
+}
+
+static void flatten(struct tracklist_node *t, void **items, size_t *i)
+{
+  if (!t)
+    return;
+
+  flatten(t->left, items, i);
+  items[(*i)++] = t->item;
+  flatten(t->right, items, i);
+}
+
+static void unflatten(struct tracklist_node *t, void **items, size_t *i)
+{
+  if (!t)
+    return;
+
+  unflatten(t->left, items, i);
+  t->item = items[(*i)++];
+  unflatten(t->right, items, i);
+}
+
+/*
+ * Fisher-Yates over the items; the tree keeps its shape.
+ */
+void tracklist_shuffle(struct tracklist *l)
+{
+  size_t i, j, n = size(l->root);
+  void **items, *tmp;
+
+  if (n < 2)
+    return;
+
+  items = malloc(n * sizeof(*items));
+  if (!items)
+    return;
+
+  i = 0;
+  flatten(l->root, items, &i);
+
+  for (i = n - 1; i > 0; --i) {
+    j = ((uint64_t) next_prio(l) * (i + 1)) >> 32;
+    tmp = items[i];
+    items[i] = items[j];
+    items[j] = tmp;
+  }
+
+  i = 0;
+  unflatten(l->root, items, &i);
+  free(items);
+}
+
+/*
+ * In-order walk that skips whole subtrees before pos: O(log n + max).
+ */
+static void page(const struct tracklist_node *t, size_t pos, void **items, size_t max, size_t *n)
+{
+  if (!t || *n == max)
+    return;
+
+  if (pos < size(t->left))
+    page(t->left, pos, items, max, n);
+  if (*n == max)
+    return;
+
+  if (pos <= size(t->left))
+    items[(*n)++] = t->item;
+
+  pos = pos > size(t->left) ? pos - size(t->left) - 1 : 0;
+  page(t->right, pos, items, max, n);
+}
+
+size_t tracklist_page(const struct tracklist *l, size_t pos, void **items, size_t max)
+{
+  size_t n = 0;
+
+  page(l->root, pos, items, max, &n);
+  return n;
+}
+
+static void clear(struct tracklist_node *t, void (*release)(void *))
+{
+  if (!t)
+    return;
+
+  clear(t->left, release);
+  clear(t->right, release);
+  if (release)
+    release(t->item);
+  free(t);
+}
+
+void tracklist_clear(struct tracklist *l, void (*release)(void *))
+{
+  clear(l->root, release);
+  l->root = NULL;
+}
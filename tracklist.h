@@ -0,0 +1,41 @@
+#ifndef _TRACKLIST_H_
+#define _TRACKLIST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Indexed sequence of opaque items, kept as an implicit treap: every node
+ * knows the size of its subtree, so lookup, insert, remove and move at a
+ * position are O(log n) expected, and bulk inserts build their subtree in
+ * O(n) before a single merge.
+ */
+struct tracklist_node;
+
+struct tracklist {
+  struct tracklist_node *root;
+  uint32_t seed;
+};
+
+size_t tracklist_len(const struct tracklist *l);
+
+/* Memory n items take, for budgeting */
+size_t tracklist_bytes(size_t n);
+void  *tracklist_get(const struct tracklist *l, size_t pos);
+
+/* pos is clamped to the length, so (size_t) -1 appends */
+int    tracklist_insert(struct tracklist *l, size_t pos, void *item);
+int    tracklist_insert_many(struct tracklist *l, size_t pos, void **items, size_t n);
+void  *tracklist_remove(struct tracklist *l, size_t pos);
+int    tracklist_move(struct tracklist *l, size_t from, size_t to);
+
+/*
+ * Seed the generator behind node priorities and tracklist_shuffle(). An
+ * unseeded list (or seed 0) uses a fixed seed, so runs repeat exactly.
+ */
+void   tracklist_seed(struct tracklist *l, uint32_t seed);
+void   tracklist_shuffle(struct tracklist *l);
+size_t tracklist_page(const struct tracklist *l, size_t pos, void **items, size_t max);
+void   tracklist_clear(struct tracklist *l, void (*release)(void *));
+
+#endif